@@ -0,0 +1,722 @@
+// bcache.c - LRU block cache
+//
+// The cache is itself an io_intf, so it can be stacked on top of any block
+// device: reads are served from cached blocks when possible, and a miss pulls
+// the whole BCACHE_BLKSZ block in from the backing device. Writes either go
+// straight through to the device and update any copy that is already cached,
+// or (BCACHE_WRITEBACK) only dirty the cached block; dirty blocks are written
+// back in block order, with runs of adjacent blocks gathered into one write.
+
+#include "bcache.h"
+#include "ioext.h"
+#include "memory.h"
+#include "string.h"
+#include "error.h"
+#include "intr.h"
+#include "timer.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+#define MIN(a,b) (((a)<(b))?(a):(b))
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+extern void * memory_alloc_pages(unsigned int order); // memory.c
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void bcache_close(struct io_intf * io);
+static long bcache_read(struct io_intf * io, void * buf, unsigned long n);
+static long bcache_write(struct io_intf * io, const void * buf, unsigned long n);
+static int bcache_ioctl(struct io_intf * io, int cmd, void * arg);
+
+static struct bcache_buf * bcache_lookup(struct bcache * bc, uint64_t blkno);
+static long bcache_read_at (
+    struct bcache * bc, uint64_t pos, void * buf, unsigned long n);
+static long bcache_write_at (
+    struct bcache * bc, uint64_t pos, const void * buf, unsigned long n);
+static struct bcache_buf * bcache_get(struct bcache * bc, uint64_t blkno);
+static struct bcache_buf * bcache_claim(struct bcache * bc, uint64_t blkno);
+static struct bcache_buf * bcache_fill(struct bcache * bc, uint64_t blkno);
+static void bcache_wait(struct bcache * bc);
+static int bcache_range(struct bcache * bc, int cmd, const struct io_range * rg);
+static struct bcache_buf * bcache_get_for_write (
+    struct bcache * bc, uint64_t blkno, int whole);
+static int bcache_writeback(struct bcache * bc);
+static void bcache_flusher(void * arg);
+static unsigned long bcache_miss_run (
+    struct bcache * bc, uint64_t blkno, unsigned long max);
+static long bcache_read_run (
+    struct bcache * bc, uint64_t blkno, unsigned long cnt, void * buf);
+static void lru_remove(struct bcache * bc, struct bcache_buf * bp);
+static void lru_push_front(struct bcache * bc, struct bcache_buf * bp);
+static void lru_push_back(struct bcache * bc, struct bcache_buf * bp);
+static void hash_remove(struct bcache * bc, struct bcache_buf * bp);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+struct io_intf * bcache_init(struct bcache * bc, struct io_intf * rawio) {
+    static const struct io_ops ops = {
+        .close = bcache_close,
+        .read = bcache_read,
+        .write = bcache_write,
+        .ctl = bcache_ioctl
+    };
+
+    memset(bc, 0, sizeof(struct bcache));
+
+    if (ioctl(rawio, IOCTL_GETLEN, &bc->size) != 0)
+        return NULL;
+
+    bc->io_intf.ops = &ops;
+    bc->io_intf.refcnt = 1;
+    bc->rawio = rawio;
+    lock_init(&bc->lock, "bcache_lock");
+    condition_init(&bc->filled, "bcache_filled");
+
+    // Every buffer starts out invalid on the LRU list. Data pages come straight
+    // from the page allocator so the budget is exactly BCACHE_NBUF pages.
+
+    for (int i = 0; i < BCACHE_NBUF; i++) {
+        bc->bufs[i].data = memory_alloc_page();
+        lru_push_front(bc, &bc->bufs[i]);
+    }
+
+    if (BCACHE_WRITEBACK) {
+        bc->flushbuf = memory_alloc_pages(BCACHE_FLUSH_ORDER); //too big for the heap
+        thread_spawn("bcache_flusher", bcache_flusher, bc);
+    }
+
+    return &bc->io_intf;
+}
+
+void bcache_prefetch(struct bcache * bc, uint64_t pos) {
+    uint64_t const blkno = pos / BCACHE_BLKSZ;
+
+    lock_acquire(&bc->lock);
+
+    if (pos < bc->size && bcache_lookup(bc, blkno) == NULL) {
+        bc->stats.prefetches += 1;
+        bcache_fill(bc, blkno);
+    }
+
+    lock_release(&bc->lock);
+}
+
+int bcache_flush(struct bcache * bc) {
+    int result;
+
+    lock_acquire(&bc->lock);
+    result = bcache_writeback(bc);
+    lock_release(&bc->lock);
+
+    if (result != 0)
+        return result;
+
+    // Devices without a write cache of their own have nothing more to do
+
+    result = ioctl(bc->rawio, IOCTL_FLUSH, NULL);
+
+    return (result == -ENOTSUP) ? 0 : result;
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+void bcache_close(struct io_intf * io) {
+    struct bcache * const bc = (void*)io - offsetof(struct bcache, io_intf);
+    bcache_flush(bc);
+    ioclose(bc->rawio);
+}
+
+// Reads from the current position, one cached block at a time.
+
+long bcache_read(struct io_intf * io, void * buf, unsigned long n) {
+    struct bcache * const bc = (void*)io - offsetof(struct bcache, io_intf);
+    long result;
+
+    lock_acquire(&bc->lock);
+    result = bcache_read_at(bc, bc->pos, buf, n);
+    if (result > 0)
+        bc->pos += result;
+    lock_release(&bc->lock);
+    return result;
+}
+
+// Writes at the current position (see bcache_write_at).
+
+long bcache_write(struct io_intf * io, const void * buf, unsigned long n) {
+    struct bcache * const bc = (void*)io - offsetof(struct bcache, io_intf);
+    long result;
+
+    lock_acquire(&bc->lock);
+    result = bcache_write_at(bc, bc->pos, buf, n);
+    if (result > 0)
+        bc->pos += result;
+    lock_release(&bc->lock);
+    return result;
+}
+
+int bcache_ioctl(struct io_intf * io, int cmd, void * arg) {
+    struct bcache * const bc = (void*)io - offsetof(struct bcache, io_intf);
+    int result = 0;
+
+    if (cmd == IOCTL_FLUSH)
+        return bcache_flush(bc);
+
+    if (arg == NULL)
+        return -EINVAL;
+
+    switch (cmd) {
+    case IOCTL_GETLEN:
+        *(uint64_t*)arg = bc->size;
+        break;
+    case IOCTL_GETPOS:
+        *(uint64_t*)arg = bc->pos;
+        break;
+    case IOCTL_SETPOS:
+        if (*(uint64_t*)arg > bc->size)
+            return -EINVAL;
+        lock_acquire(&bc->lock);
+        bc->pos = *(uint64_t*)arg;
+        lock_release(&bc->lock);
+        break;
+    case IOCTL_GETCACHESTATS:
+        memcpy(arg, &bc->stats, sizeof(struct bcache_stats));
+        break;
+    case IOCTL_READAT:
+        lock_acquire(&bc->lock);
+        result = bcache_read_at(bc, ((struct io_posrw*)arg)->pos,
+            ((struct io_posrw*)arg)->buf, ((struct io_posrw*)arg)->len);
+        lock_release(&bc->lock);
+        break;
+    case IOCTL_WRITEAT:
+        lock_acquire(&bc->lock);
+        result = bcache_write_at(bc, ((struct io_posrw*)arg)->pos,
+            ((struct io_posrw*)arg)->buf, ((struct io_posrw*)arg)->len);
+        lock_release(&bc->lock);
+        break;
+    case IOCTL_DISCARD:
+    case IOCTL_ZERO_RANGE:
+        lock_acquire(&bc->lock);
+        result = bcache_range(bc, cmd, arg);
+        lock_release(&bc->lock);
+        break;
+    default:
+        // Everything else (block size, ...) is a property of the device
+        result = ioctl(bc->rawio, cmd, arg);
+    }
+
+    return result;
+}
+
+// Returns the cached buffer holding /blkno/, or NULL if it isn't cached.
+
+struct bcache_buf * bcache_lookup(struct bcache * bc, uint64_t blkno) {
+    struct bcache_buf * bp;
+
+    for (bp = bc->hash[blkno % BCACHE_NHASH]; bp != NULL; bp = bp->hash_next) {
+        if (bp->blkno == blkno)
+            return bp;
+    }
+
+    return NULL;
+}
+
+// Reads n bytes at pos through the cache without touching bc->pos. Caller
+// holds bc->lock.
+
+long bcache_read_at(struct bcache * bc, uint64_t pos, void * buf, unsigned long n) {
+    unsigned long acc = 0; // bytes copied out so far
+    struct bcache_buf * bp;
+
+    if (pos >= bc->size)
+        return 0;
+
+    if (n > bc->size - pos)
+        n = bc->size - pos;
+
+    while (acc < n) {
+        uint64_t blkno = pos / BCACHE_BLKSZ;
+        unsigned long blkoff = pos % BCACHE_BLKSZ;
+        unsigned long cnt = MIN(BCACHE_BLKSZ - blkoff, n - acc);
+
+        // Runs of whole blocks that are all missing go to the device as one
+        // transfer straight into the caller's buffer.
+
+        if (blkoff == 0 && cnt == BCACHE_BLKSZ) {
+            unsigned long run = bcache_miss_run(bc, blkno, (n - acc) / BCACHE_BLKSZ);
+            if (run > 1) {
+                long result = bcache_read_run(bc, blkno, run, buf + acc);
+                if (result < 0)
+                    return (acc != 0) ? acc : result;
+                acc += result;
+                pos += result;
+                continue;
+            }
+        }
+
+        bp = bcache_get(bc, blkno);
+        if (bp == NULL)
+            return (acc != 0) ? acc : -EIO;
+
+        memcpy(buf + acc, bp->data + blkoff, cnt);
+        acc += cnt;
+        pos += cnt;
+    }
+
+    return acc;
+}
+
+// Writes n bytes at pos without touching bc->pos. In write-back mode the
+// blocks are only updated in the cache and marked dirty. Otherwise the data
+// goes through to the backing device; blocks that are already cached are
+// updated in place and blocks that aren't stay uncached rather than paying for
+// a read just to fill them. Caller holds bc->lock.
+
+long bcache_write_at(struct bcache * bc, uint64_t pos, const void * buf, unsigned long n) {
+    unsigned long acc = 0;
+    long result;
+
+    if (pos >= bc->size)
+        return 0;
+
+    if (n > bc->size - pos)
+        n = bc->size - pos;
+
+    if (n == 0)
+        return 0; // the write-through range below would wrap
+
+    if (BCACHE_WRITEBACK) {
+        while (acc < n) {
+            uint64_t blkno = pos / BCACHE_BLKSZ;
+            unsigned long blkoff = pos % BCACHE_BLKSZ;
+            unsigned long cnt = MIN(BCACHE_BLKSZ - blkoff, n - acc);
+            int whole = (blkoff == 0 && cnt == MIN(BCACHE_BLKSZ, bc->size - pos));
+            struct bcache_buf * const bp = bcache_get_for_write(bc, blkno, whole);
+
+            if (bp == NULL)
+                return (acc != 0) ? acc : -EIO;
+
+            memcpy(bp->data + blkoff, buf + acc, cnt);
+            bp->dirty = 1;
+            acc += cnt;
+            pos += cnt;
+        }
+
+        return acc;
+    }
+
+    // A block still being filled could be read from the device before this
+    // write lands and then overwrite the copy made below, so let any fills in
+    // the range finish first. No new fill can start while we hold bc->lock.
+
+    for (uint64_t blkno = pos / BCACHE_BLKSZ; blkno <= (pos + n - 1) / BCACHE_BLKSZ; blkno++) {
+        struct bcache_buf * const bp = bcache_lookup(bc, blkno);
+        if (bp != NULL && bp->busy) {
+            bcache_wait(bc);
+            blkno = pos / BCACHE_BLKSZ - 1; // start over, anything may have changed
+        }
+    }
+
+    result = iowriteat(bc->rawio, pos, buf, n);
+
+    if (result < 0)
+        return result;
+
+    n = result; // only update the cache for what actually made it to the device
+
+    while (acc < n) {
+        uint64_t blkno = pos / BCACHE_BLKSZ;
+        unsigned long blkoff = pos % BCACHE_BLKSZ;
+        unsigned long cnt = MIN(BCACHE_BLKSZ - blkoff, n - acc);
+        struct bcache_buf * const bp = bcache_lookup(bc, blkno);
+
+        if (bp != NULL)
+            memcpy(bp->data + blkoff, buf + acc, cnt);
+
+        acc += cnt;
+        pos += cnt;
+    }
+
+    return acc;
+}
+
+// Returns a valid buffer for /blkno/ that is about to be written to. If the
+// write covers the whole block (/whole/), a missing block is not read in first
+// since all of it is about to be overwritten. Returns NULL on a device error.
+// Caller must hold bc->lock.
+
+struct bcache_buf * bcache_get_for_write (
+    struct bcache * bc, uint64_t blkno, int whole)
+{
+    struct bcache_buf * bp;
+
+    if (!whole)
+        return bcache_get(bc, blkno);
+
+    while ((bp = bcache_lookup(bc, blkno)) != NULL && bp->busy)
+        bcache_wait(bc);
+
+    if (bp != NULL) {
+        lru_remove(bc, bp);
+        lru_push_front(bc, bp);
+        return bp;
+    }
+
+    bp = bcache_claim(bc, blkno);
+    if (bp != NULL)
+        bp->valid = 1;
+    return bp;
+}
+
+// Writes every dirty block back to the device in block order. Adjacent dirty
+// blocks are gathered in bc->flushbuf and written with one device write. The
+// device's own write cache is not flushed. Returns 0 or a negative error code;
+// blocks that couldn't be written stay dirty. Caller must hold bc->lock.
+
+int bcache_writeback(struct bcache * bc) {
+    struct bcache_buf * dirty[BCACHE_NBUF];
+    unsigned long ndirty = 0;
+    unsigned long i, j, k;
+    int ret = 0;
+
+    for (i = 0; i < BCACHE_NBUF; i++) {
+        struct bcache_buf * const bp = &bc->bufs[i];
+
+        if (!bp->dirty)
+            continue;
+
+        // Insertion sort by block number; there are at most BCACHE_NBUF
+
+        for (j = ndirty; j > 0 && dirty[j-1]->blkno > bp->blkno; j--)
+            dirty[j] = dirty[j-1];
+        dirty[j] = bp;
+        ndirty += 1;
+    }
+
+    for (i = 0; i < ndirty; i = j) {
+        uint64_t const pos = dirty[i]->blkno * BCACHE_BLKSZ;
+        const void * src;
+        long len;
+        long result;
+
+        for (j = i + 1; j < ndirty && j - i < BCACHE_FLUSH_RUN &&
+            dirty[j]->blkno == dirty[j-1]->blkno + 1; j++)
+            continue;
+
+        if (j - i == 1) {
+            src = dirty[i]->data;
+        } else {
+            for (k = i; k < j; k++)
+                memcpy(bc->flushbuf + (k - i) * BCACHE_BLKSZ,
+                    dirty[k]->data, BCACHE_BLKSZ);
+            src = bc->flushbuf;
+        }
+
+        len = MIN((j - i) * BCACHE_BLKSZ, bc->size - pos); // last block may be short
+        result = iowriteat(bc->rawio, pos, src, len);
+
+        if (result != len) {
+            ret = (result < 0) ? result : -EIO;
+            continue;
+        }
+
+        for (k = i; k < j; k++)
+            dirty[k]->dirty = 0;
+
+        bc->stats.writebacks += j - i;
+        bc->stats.flushes += 1;
+    }
+
+    return ret;
+}
+
+// Flusher thread: writes dirty blocks back every BCACHE_FLUSH_MS so they don't
+// sit in memory indefinitely if nothing else forces them out.
+
+void bcache_flusher(void * arg) {
+    struct bcache * const bc = arg;
+    struct alarm al;
+
+    alarm_init(&al, "bcache_flusher");
+
+    for (;;) {
+        alarm_sleep(&al, BCACHE_FLUSH_MS * (TIMER_FREQ / 1000));
+        bcache_flush(bc);
+    }
+}
+
+// Returns a valid buffer holding /blkno/ and marks it most recently used. On a
+// miss, the least recently used buffer is recycled and filled from the device.
+// Returns NULL if the device read fails. Caller must hold bc->lock.
+
+struct bcache_buf * bcache_get(struct bcache * bc, uint64_t blkno) {
+    struct bcache_buf * bp;
+
+    // A buffer that is still being filled (e.g. by readahead) is waited for
+    // rather than read a second time.
+
+    while ((bp = bcache_lookup(bc, blkno)) != NULL && bp->busy)
+        bcache_wait(bc);
+
+    if (bp != NULL) {
+        bc->stats.hits += 1;
+        lru_remove(bc, bp);
+        lru_push_front(bc, bp);
+        return bp;
+    }
+
+    bc->stats.misses += 1;
+    return bcache_fill(bc, blkno);
+}
+
+// Recycles the least recently used idle buffer for /blkno/: evicts whatever it
+// held, hashes it under /blkno/ (still invalid) and makes it most recently used.
+// Returns NULL if the buffer was dirty and couldn't be written back.
+// Caller must hold bc->lock and must fill the buffer.
+
+struct bcache_buf * bcache_claim(struct bcache * bc, uint64_t blkno) {
+    struct bcache_buf * bp;
+
+    for (;;) {
+        for (bp = bc->lru; bp != NULL && bp->busy; bp = bp->lru_prev)
+            continue;
+        if (bp != NULL)
+            break;
+        bcache_wait(bc); // every buffer is mid-read
+    }
+
+    // A dirty victim has to reach the device before its buffer is reused. Every
+    // other dirty block goes along with it, since they're cheaper to write as
+    // one sorted batch than one eviction at a time.
+
+    if (bp->dirty && (bcache_writeback(bc) != 0 || bp->dirty))
+        return NULL;
+
+    lru_remove(bc, bp);
+
+    if (bp->valid) {
+        bc->stats.evictions += 1;
+        hash_remove(bc, bp);
+        bp->valid = 0;
+    }
+
+    bp->blkno = blkno;
+    bp->hash_next = bc->hash[blkno % BCACHE_NHASH];
+    bc->hash[blkno % BCACHE_NHASH] = bp;
+    lru_push_front(bc, bp);
+
+    return bp;
+}
+
+// Claims a buffer for /blkno/ and reads the block into it. bc->lock is dropped
+// while the device is busy so that hits on other blocks aren't held up behind
+// the read; the buffer is marked busy meanwhile.
+// Returns NULL if the device read fails. Caller must hold bc->lock.
+
+struct bcache_buf * bcache_fill(struct bcache * bc, uint64_t blkno) {
+    struct bcache_buf * bp;
+    uint64_t pos;
+    long len;
+    int ok;
+
+    bp = bcache_claim(bc, blkno);
+    if (bp == NULL)
+        return NULL;
+    bp->busy = 1;
+    lock_release(&bc->lock);
+
+    // The last block of the device may be short
+
+    pos = blkno * BCACHE_BLKSZ;
+    len = MIN(BCACHE_BLKSZ, bc->size - pos);
+
+    ok = (ioreadat(bc->rawio, pos, bp->data, len) == len);
+
+    lock_acquire(&bc->lock);
+    bp->busy = 0;
+    condition_broadcast(&bc->filled);
+
+    if (!ok) {
+        // Leave the buffer invalid at the LRU end so it's reused first
+        hash_remove(bc, bp);
+        lru_remove(bc, bp);
+        lru_push_back(bc, bp);
+        return NULL;
+    }
+
+    bp->valid = 1;
+    return bp;
+}
+
+// Returns how many consecutive blocks starting at /blkno/ (at most /max/) are
+// not in the cache at all. Caller must hold bc->lock.
+
+unsigned long bcache_miss_run (
+    struct bcache * bc, uint64_t blkno, unsigned long max)
+{
+    unsigned long cnt = 0;
+
+    while (cnt < max && bcache_lookup(bc, blkno + cnt) == NULL)
+        cnt += 1;
+
+    return cnt;
+}
+
+// Reads /cnt/ whole uncached blocks starting at /blkno/ into /buf/ with one
+// device transfer, then copies them into the cache so later reads hit. bc->lock
+// stays held so a concurrent write can't slip in between the read and the
+// cache fill. Returns the number of bytes read or a negative error code.
+
+long bcache_read_run (
+    struct bcache * bc, uint64_t blkno, unsigned long cnt, void * buf)
+{
+    uint64_t pos = blkno * BCACHE_BLKSZ;
+    long const len = cnt * BCACHE_BLKSZ;
+    struct bcache_buf * bp;
+    long result;
+
+    bc->stats.misses += cnt;
+
+    result = ioreadat(bc->rawio, pos, buf, len);
+
+    if (result < 0)
+        return result;
+    if (result != len)
+        return -EIO;
+
+    for (unsigned long i = 0; i < cnt; i++) {
+        if (bcache_lookup(bc, blkno + i) != NULL)
+            continue; // readahead got there first
+        bp = bcache_claim(bc, blkno + i);
+        if (bp == NULL)
+            break; // the data still made it to the caller
+        memcpy(bp->data, buf + i * BCACHE_BLKSZ, BCACHE_BLKSZ);
+        bp->valid = 1;
+    }
+
+    return len;
+}
+
+// Drops bc->lock until some buffer finishes filling, then takes it back.
+
+void bcache_wait(struct bcache * bc) {
+    int s = intr_disable();
+    lock_release(&bc->lock);
+    condition_wait(&bc->filled);
+    intr_restore(s);
+    lock_acquire(&bc->lock);
+}
+
+// Passes IOCTL_DISCARD or IOCTL_ZERO_RANGE on to the device and brings cached
+// blocks in the range in line with it: zeroed bytes are zeroed in the cache
+// too, and blocks discarded whole are dropped, dirty or not, since their
+// contents don't matter any more. Reads into blocks in the range are waited
+// out first so they can't bring back the old data; bc->lock is held from then
+// on, so no new ones start. Caller must hold bc->lock.
+
+int bcache_range(struct bcache * bc, int cmd, const struct io_range * rg) {
+    uint64_t const end = rg->pos + rg->len;
+    int result;
+    int i;
+
+    for (i = 0; i < BCACHE_NBUF; i++) {
+        struct bcache_buf * const bp = &bc->bufs[i];
+
+        if (bp->busy && bp->blkno * BCACHE_BLKSZ < end &&
+            rg->pos < (bp->blkno + 1) * BCACHE_BLKSZ) {
+            bcache_wait(bc);
+            i = -1; // start over, anything may have changed
+        }
+    }
+
+    result = ioctl(bc->rawio, cmd, (void *)rg);
+    if (result != 0)
+        return result;
+
+    for (i = 0; i < BCACHE_NBUF; i++) {
+        struct bcache_buf * const bp = &bc->bufs[i];
+        uint64_t const start = bp->blkno * BCACHE_BLKSZ;
+        uint64_t const lo = (start > rg->pos) ? start : rg->pos;
+        uint64_t const hi = MIN(start + BCACHE_BLKSZ, end);
+        int const whole = (lo == start && hi == start + BCACHE_BLKSZ);
+
+        if (!bp->valid || lo >= hi)
+            continue;
+
+        if (cmd == IOCTL_ZERO_RANGE) {
+            memset(bp->data + (lo - start), 0, hi - lo);
+            if (whole)
+                bp->dirty = 0; // the device has the same zeroes now
+        } else if (whole) {
+            hash_remove(bc, bp);
+            bp->valid = 0;
+            bp->dirty = 0;
+            lru_remove(bc, bp);
+            lru_push_back(bc, bp);
+        }
+    }
+
+    return 0;
+}
+
+void lru_remove(struct bcache * bc, struct bcache_buf * bp) {
+    if (bp->lru_prev != NULL)
+        bp->lru_prev->lru_next = bp->lru_next;
+    else
+        bc->mru = bp->lru_next;
+
+    if (bp->lru_next != NULL)
+        bp->lru_next->lru_prev = bp->lru_prev;
+    else
+        bc->lru = bp->lru_prev;
+
+    bp->lru_prev = NULL;
+    bp->lru_next = NULL;
+}
+
+void lru_push_front(struct bcache * bc, struct bcache_buf * bp) {
+    bp->lru_prev = NULL;
+    bp->lru_next = bc->mru;
+
+    if (bc->mru != NULL)
+        bc->mru->lru_prev = bp;
+    else
+        bc->lru = bp;
+
+    bc->mru = bp;
+}
+
+void lru_push_back(struct bcache * bc, struct bcache_buf * bp) {
+    bp->lru_next = NULL;
+    bp->lru_prev = bc->lru;
+
+    if (bc->lru != NULL)
+        bc->lru->lru_next = bp;
+    else
+        bc->mru = bp;
+
+    bc->lru = bp;
+}
+
+void hash_remove(struct bcache * bc, struct bcache_buf * bp) {
+    struct bcache_buf ** link = &bc->hash[bp->blkno % BCACHE_NHASH];
+
+    while (*link != NULL) {
+        if (*link == bp) {
+            *link = bp->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+
+    bp->hash_next = NULL;
+}
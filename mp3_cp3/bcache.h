@@ -0,0 +1,107 @@
+// bcache.h - LRU block cache that sits between a filesystem and a block device
+//
+
+#ifndef _BCACHE_H_
+#define _BCACHE_H_
+
+#include "io.h"
+#include "lock.h"
+
+#include <stdint.h>
+
+// COMPILE-TIME PARAMETERS
+//
+
+// BCACHE_NBUF is the number of cached blocks. Each block is one page, so the
+// cache never uses more than BCACHE_NBUF pages.
+
+#ifndef BCACHE_NBUF
+#define BCACHE_NBUF 64
+#endif
+
+// Size of a cached block. A multiple of the sector size of any block device.
+
+#define BCACHE_BLKSZ 4096
+
+// Number of hash chains used to find a cached block by block number
+
+#define BCACHE_NHASH 32
+
+// With BCACHE_WRITEBACK set, writes only dirty the cached block and the device
+// sees them later, when the block is evicted, on IOCTL_FLUSH, or every
+// BCACHE_FLUSH_MS milliseconds. Set it to 0 to write through instead.
+
+#ifndef BCACHE_WRITEBACK
+#define BCACHE_WRITEBACK 1
+#endif
+
+#ifndef BCACHE_FLUSH_MS
+#define BCACHE_FLUSH_MS 1000
+#endif
+
+// Largest number of adjacent dirty blocks written back with one device write.
+// The buffer they're gathered in is one block of 2^BCACHE_FLUSH_ORDER pages from
+// the page allocator.
+
+#define BCACHE_FLUSH_ORDER 3
+#define BCACHE_FLUSH_RUN (1 << BCACHE_FLUSH_ORDER)
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct bcache_buf {
+    struct bcache_buf * lru_prev; // toward most recently used
+    struct bcache_buf * lru_next; // toward least recently used
+    struct bcache_buf * hash_next; // next buffer on the same hash chain
+    uint64_t blkno; // block number on the backing device
+    char * data; // BCACHE_BLKSZ bytes (one page)
+    int8_t valid; // data holds the contents of blkno
+    int8_t busy; // being filled from the device; wait on bcache.filled
+    int8_t dirty; // modified in the cache but not written back yet
+};
+
+struct bcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t prefetches; // blocks read ahead of being asked for
+    uint64_t writebacks; // dirty blocks written back to the device
+    uint64_t flushes; // device writes used for those (runs are coalesced)
+};
+
+struct bcache {
+    struct io_intf io_intf;
+    struct io_intf * rawio; // backing block device
+    uint64_t pos; // current position
+    uint64_t size; // size of the backing device in bytes
+    struct bcache_buf bufs[BCACHE_NBUF];
+    struct bcache_buf * mru; // head of the LRU list
+    struct bcache_buf * lru; // tail of the LRU list, next to be evicted
+    struct bcache_buf * hash[BCACHE_NHASH];
+    struct bcache_stats stats;
+    struct lock lock; // protects everything above
+    struct condition filled; // a busy buffer finished filling
+    char * flushbuf; // BCACHE_FLUSH_RUN blocks to gather a run of dirty blocks in
+};
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+// Sets up a block cache in front of /rawio/ and returns the io interface to use
+// in its place. Returns NULL if the size of the backing device can't be read.
+
+extern struct io_intf * bcache_init(struct bcache * bc, struct io_intf * rawio);
+
+// Makes sure the block containing device position /pos/ is cached, reading it
+// in if needed. Used for readahead; errors are ignored since the block will be
+// read again when it is actually asked for.
+
+extern void bcache_prefetch(struct bcache * bc, uint64_t pos);
+
+// Writes every dirty block back to the device and asks the device to flush its
+// own write cache. Same as IOCTL_FLUSH on the cache's io interface.
+// Returns 0 or a negative error code.
+
+extern int bcache_flush(struct bcache * bc);
+
+#endif // _BCACHE_H_
@@ -0,0 +1,165 @@
+// ioext.h - ioctl commands beyond the ones in io.h
+//
+
+#ifndef _IOEXT_H_
+#define _IOEXT_H_
+
+#include "io.h"
+#include "error.h"
+
+// These start well above the io.h commands so the two sets never collide.
+
+#define IOCTL_GETCACHESTATS     32  // arg: struct bcache_stats * (bcache.h)
+#define IOCTL_READAT            33  // arg: struct io_posrw *, returns bytes read
+#define IOCTL_WRITEAT           34  // arg: struct io_posrw *, returns bytes written
+#define IOCTL_GETINO            35  // arg: uint64_t *, number identifying the file
+#define IOCTL_GETSCHEDSTATS     36  // arg: struct io_schedstats *
+#define IOCTL_SETSCHED          37  // arg: int *, one of the IO_SCHED_ policies
+#define IOCTL_GETLATSTATS       38  // arg: struct io_latstats *
+#define IOCTL_SETPOLL           39  // arg: unsigned long *, microseconds to poll (0: off)
+#define IOCTL_DISCARD           40  // arg: struct io_range *, contents no longer needed
+#define IOCTL_ZERO_RANGE        41  // arg: struct io_range *, reads back as zeroes
+#define IOCTL_GETSTATS          42  // arg: struct io_blkstats *
+
+// Request scheduler policies for IOCTL_SETSCHED. NOOP hands requests to the
+// device in the order they arrive; ELEVATOR sorts them by sector, sweeping
+// upward and wrapping around, unless the oldest one has waited too long.
+// Both merge requests for adjacent sectors.
+
+#define IO_SCHED_NOOP           0
+#define IO_SCHED_ELEVATOR       1
+#define IO_SCHED_NPOLICY        2
+
+// Argument to IOCTL_READAT/IOCTL_WRITEAT. The transfer starts at pos and the
+// endpoint's own position is left where it was.
+
+struct io_posrw {
+    uint64_t pos;
+    void * buf;
+    unsigned long len;
+};
+
+// Argument to IOCTL_DISCARD/IOCTL_ZERO_RANGE: len bytes starting at pos.
+
+struct io_range {
+    uint64_t pos;
+    uint64_t len;
+};
+
+// Argument to IOCTL_GETSCHEDSTATS: counters kept separately for each policy
+// since the device was attached. Times are in timer ticks (TIMER_FREQ a second).
+
+struct io_schedstats {
+    int policy; // the one in use
+    struct {
+        uint64_t requests; // submitted while the policy was in use
+        uint64_t merges; // merged into a request that was already queued
+        uint64_t dispatches; // handed to the device (merged ones count once)
+        uint64_t wait; // total time between queueing and dispatch
+        uint64_t avgwait; // wait / dispatches
+    } pol[IO_SCHED_NPOLICY];
+};
+
+// Ways a block request can wait for its completion: sleep until the device
+// interrupts, or busy-poll for a while first (IOCTL_SETPOLL).
+
+#define IO_WAIT_IRQ             0
+#define IO_WAIT_POLL            1
+#define IO_WAIT_NMODE           2
+
+// Argument to IOCTL_GETLATSTATS: latency from submitting a request to its
+// completion, for each way of waiting. Percentiles are the upper end of the
+// power-of-two histogram bucket they fall in, in timer ticks.
+
+struct io_latstats {
+    unsigned long poll_us; // polling budget in use
+    struct {
+        uint64_t requests;
+        uint64_t p50;
+        uint64_t p99;
+    } mode[IO_WAIT_NMODE];
+};
+
+// Buckets in block device latency histograms: bucket b counts requests that
+// took [2^b, 2^(b+1)) timer ticks.
+
+#define IO_LAT_NBUCKETS         40
+
+// Stages of a block request timed for IOCTL_GETSTATS. A request is stamped when
+// it is submitted, when it is handed to the device (notify), when its completion
+// is handled (ISR, or the polling thread) and when its thread runs again
+// (wakeup). QUEUE is time spent in the request scheduler, DEVICE time spent in
+// the device, WAKEUP time spent waiting for the thread scheduler.
+
+#define IO_STAGE_QUEUE          0   // submit to notify
+#define IO_STAGE_DEVICE         1   // notify to ISR
+#define IO_STAGE_WAKEUP         2   // ISR to wakeup
+#define IO_STAGE_TOTAL          3   // submit to wakeup
+#define IO_STAGE_N              4
+
+// Argument to IOCTL_GETSTATS: counters since the device was attached. Times are
+// in timer ticks (TIMER_FREQ a second).
+
+struct io_blkstats {
+    uint64_t reads; // requests
+    uint64_t writes;
+    uint64_t rbytes;
+    uint64_t wbytes;
+    uint64_t errors; // requests the device reported an error for
+    struct {
+        uint64_t samples; // one per request, when it is submitted
+        uint64_t sum; // requests queued or in flight ahead of it
+        uint64_t max;
+    } depth;
+    struct {
+        uint64_t total;
+        uint64_t hist[IO_LAT_NBUCKETS];
+    } stage[IO_STAGE_N];
+};
+
+static inline long ioreadat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long len);
+static inline long iowriteat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long len);
+
+// INLINE FUNCTION DEFINITIONS
+//
+
+// Reads len bytes at pos. Endpoints that don't support IOCTL_READAT get a seek
+// followed by a read instead, which does move their position.
+
+static inline long ioreadat (
+    struct io_intf * io, uint64_t pos, void * buf, unsigned long len)
+{
+    struct io_posrw rw = { .pos = pos, .buf = buf, .len = len };
+    long result;
+
+    result = ioctl(io, IOCTL_READAT, &rw);
+    if (result != -ENOTSUP)
+        return result;
+
+    result = ioseek(io, pos);
+    if (result < 0)
+        return result;
+    return ioread_full(io, buf, len);
+}
+
+// Writes len bytes at pos, with the same fallback as ioreadat.
+
+static inline long iowriteat (
+    struct io_intf * io, uint64_t pos, const void * buf, unsigned long len)
+{
+    struct io_posrw rw = { .pos = pos, .buf = (void *)buf, .len = len };
+    long result;
+
+    result = ioctl(io, IOCTL_WRITEAT, &rw);
+    if (result != -ENOTSUP)
+        return result;
+
+    result = ioseek(io, pos);
+    if (result < 0)
+        return result;
+    return iowrite(io, buf, len);
+}
+
+#endif // _IOEXT_H_
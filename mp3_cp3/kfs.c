@@ -3,25 +3,261 @@
 #include "error.h"
 #include "console.h"
 #include "lock.h"
+#include "memory.h"
+#include "bcache.h"
+#include "ioext.h"
+
+#include <stddef.h>
+#include <limits.h>
+
+// IMPORTED FUNCTION DECLARATIONS
+
+extern void memory_mmap_update(uint64_t ino, uint64_t pos, const void * buf, size_t len); // memory.c
+extern int memory_prepare_user_write(void * buf, size_t len); // memory.c
+
+// COMPILE-TIME PARAMETERS
+
+// KFS_RA_MAX is the largest readahead window in datablocks. 0 turns readahead off.
+#ifndef KFS_RA_MAX
+#define KFS_RA_MAX 8
+#endif
+
+// Length of the queue of datablocks waiting to be read ahead
+#define RA_QUEUE_LEN 32
+
+// Number of datablock entries that fit in an inode after the byte length
+#define INODE_MAX_BLOCKS (BLOCK_SIZE / sizeof(uint32_t) - 1)
+
+// Size of the dentry hash index. Power of two and at least twice MAX_DENTRIES so probe chains stay short
+#define DENTRY_HASH_SIZE 128
+#define DENTRY_NAME_LEN sizeof(((dentry_t*)0)->filename)
+
+// One slot of the open-addressed dentry index built by fs_mount
+struct dentry_slot {
+    uint32_t hash; // full hash of the filename, compared before falling back to strcmp
+    int16_t idx; // index into boot_block.dentries, -1 if the slot is empty
+};
+
+// Extra per-file state that doesn't fit in file_t, indexed the same as files[]
+struct file_state {
+    struct lock lock; // protects file_pos and the readahead state while a read/write/seek is in progress
+    uint32_t * inode_blk; // cached copy of the file's inode block (one page), NULL when closed
+    uint32_t nblocks; // number of datablocks the file spans
+    uint64_t ra_next; // file position a sequential read would start at
+    uint32_t ra_window; // current readahead window in datablocks, 0 after a seek
+    uint32_t ra_end; // datablock index up to which readahead has been queued
+    unsigned int users; // transfers holding or waiting on lock (file_enter), the inode outlives them
+};
 
 // IMPORTANT GLOBAL DECLARATIONS
 
 boot_block_t boot_block;
 struct io_intf* overall_io;
 file_t files[MAX_FILES];
+static struct file_state file_states[MAX_FILES];
+static struct dentry_slot dentry_index[DENTRY_HASH_SIZE];
+static int free_slots[MAX_FILES]; // stack of indices of files[] entries not in use
+static int free_top; // number of entries on free_slots
+static struct bcache kfs_bcache; // block cache stacked between kfs and the block device
+
+
+// Device positions of datablocks waiting for the readahead thread
+static uint64_t ra_queue[RA_QUEUE_LEN];
+static uint32_t ra_head; // next slot to fill
+static uint32_t ra_tail; // next slot to prefetch
+static struct condition ra_queued;
+
+// Hashes a filename (FNV-1a), stopping at the terminator or the dentry filename length.
+// @param name - Filename to hash.
+// @return 32-bit hash of the name.
+static uint32_t dentry_hash(const char* name) {
+    uint32_t hash = 2166136261u; // FNV offset basis
+    for (int i = 0; i < DENTRY_NAME_LEN && name[i] != '\0'; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u; // FNV prime
+    }
+    return hash;
+}
+
+// Builds the dentry hash index from the boot block so fs_open doesn't have to scan every dentry.
+static void dentry_index_build(void) {
+    for (int i = 0; i < DENTRY_HASH_SIZE; i++) { // mark every slot empty
+        dentry_index[i].idx = -1;
+    }
+
+    for (int i = 0; i < boot_block.stats.no_dentries; i++) {
+        uint32_t hash = dentry_hash(boot_block.dentries[i].filename);
+        uint32_t slot = hash & (DENTRY_HASH_SIZE - 1);
+        while (dentry_index[slot].idx != -1) { // linear probe to the next free slot
+            slot = (slot + 1) & (DENTRY_HASH_SIZE - 1);
+        }
+        dentry_index[slot].hash = hash;
+        dentry_index[slot].idx = i;
+    }
+}
+
+// Looks up a dentry by name using the hash index. Only names with a matching hash are compared.
+// @param name - Filename to look up.
+// @return Pointer to the dentry, or NULL if there is no file with that name.
+static dentry_t* dentry_lookup(const char* name) {
+    uint32_t hash = dentry_hash(name);
+    uint32_t slot = hash & (DENTRY_HASH_SIZE - 1);
+
+    while (dentry_index[slot].idx != -1) { // chain ends at the first empty slot
+        dentry_t* dentry = &boot_block.dentries[dentry_index[slot].idx];
+        if (dentry_index[slot].hash == hash && strcmp(dentry->filename, name) == 0) {
+            return dentry;
+        }
+        slot = (slot + 1) & (DENTRY_HASH_SIZE - 1);
+    }
+    return NULL;
+}
+
+// Gets the file an io interface belongs to. The io_intf is embedded in file_t, so this is just
+// an offset back from the pointer, same as vioblk does with its device struct.
+// @param io - Pointer to an io interface handed out by fs_open.
+// @return Pointer to the file, or NULL if it isn't open.
+static file_t* io_to_file(struct io_intf* io) {
+    file_t* file = (void*)io - offsetof(file_t, io);
+    if (!(file->flags & FILE_IN_USE)) {
+        return NULL;
+    }
+    return file;
+}
 
-// Assumption: The system will crash on errors. Locks are not explicitly released in error paths.
-static struct lock kfs_lock;
+// Returns the device position of a datablock.
+static inline uint64_t datablock_pos(uint32_t datablock_no) {
+    return (1 + boot_block.stats.no_inodes + (uint64_t)datablock_no) * BLOCK_SIZE; // skip the boot block and inodes
+}
+
+// Returns how many bytes starting at datablock_offset in datablock idx can be moved with a single
+// device transfer, i.e. how far the run of physically adjacent datablocks goes (capped at remaining).
+// @param blockmap - Datablock numbers of the file.
+// @param idx - Index of the datablock the transfer starts in.
+// @param datablock_offset - Offset of the start within that datablock.
+// @param remaining - Bytes left in the whole request.
+static uint64_t extent_len(const uint32_t* blockmap, uint64_t idx, uint32_t datablock_offset, uint64_t remaining) {
+    uint64_t len = BLOCK_SIZE - datablock_offset; // rest of the first datablock
+
+    while (len < remaining && blockmap[idx + 1] == blockmap[idx] + 1) { // next datablock follows on disk
+        len += BLOCK_SIZE;
+        idx++;
+    }
+    return (len < remaining) ? len : remaining;
+}
+
+// Gives a closed file's inode and slot back once no transfer is holding or waiting on its lock.
+// @param file - File whose last close has happened (FILE_IN_USE clear).
+static void file_release(file_t* file) {
+    struct file_state* state = &file_states[file - files];
+
+    memory_free_page(state->inode_blk); // drop the cached inode
+    state->inode_blk = NULL;
+    free_slots[free_top++] = file - files; // and give the slot back
+}
+
+// Drops a file's lock taken by file_enter. The last user out of a closed file releases it.
+// @param file - File the transfer was on.
+static void file_leave(file_t* file) {
+    struct file_state* state = &file_states[file - files];
+    int s = intr_disable();
+    int last = (--state->users == 0 && !(file->flags & FILE_IN_USE));
+    intr_restore(s);
+
+    lock_release(&state->lock);
+    if (last) {
+        file_release(file);
+    }
+}
+
+// Takes a file's lock for a transfer. The caller counts as a user of the inode while it waits,
+// so a last fs_close meanwhile leaves the inode and slot alone until file_leave.
+// @param file - File to transfer to/from.
+// @return 0 with the lock held, -EINVAL (lock not held) if the file is closed.
+static int file_enter(file_t* file) {
+    struct file_state* state = &file_states[file - files];
+    int s = intr_disable();
+
+    if (!(file->flags & FILE_IN_USE)) {
+        intr_restore(s);
+        return -EINVAL;
+    }
+    state->users++;
+    intr_restore(s);
+
+    lock_acquire(&state->lock);
+    if (!(file->flags & FILE_IN_USE) || state->inode_blk == NULL) { // closed while we waited
+        file_leave(file);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+// Readahead thread: pulls datablock positions off the queue and reads them into the block cache
+// while the process that asked for them works on the data it already has.
+static void readahead_thread_func(void* arg __attribute__ ((unused))) {
+    for (;;) {
+        int s = intr_disable();
+        while (ra_head == ra_tail) { // sleep until fs_read queues something
+            condition_wait(&ra_queued);
+        }
+        uint64_t pos = ra_queue[ra_tail % RA_QUEUE_LEN];
+        ra_tail++;
+        intr_restore(s);
+
+        bcache_prefetch(&kfs_bcache, pos);
+    }
+}
+
+// Updates a file's sequential-access state for a read of n bytes at pos and queues readahead
+// for the datablocks after it. The window doubles on every sequential read up to KFS_RA_MAX
+// and collapses back to nothing as soon as the file is read somewhere else.
+// @param state - Per-file state of the file being read.
+// @param pos - File position the read starts at.
+// @param n - Number of bytes being read (nonzero).
+static void readahead(struct file_state* state, uint64_t pos, unsigned long n) {
+    uint32_t next_idx = (pos + n + BLOCK_SIZE - 1) / BLOCK_SIZE; // first datablock past this read
+
+    if (pos == state->ra_next) { // sequential: grow the window
+        state->ra_window = (state->ra_window == 0) ? 1 : state->ra_window * 2;
+        if (state->ra_window > KFS_RA_MAX) {
+            state->ra_window = KFS_RA_MAX;
+        }
+    } else { // seek: stop reading ahead until the access pattern is sequential again
+        state->ra_window = 0;
+        state->ra_end = 0;
+    }
+    state->ra_next = pos + n;
+
+    uint32_t end = next_idx + state->ra_window; // queue up to (not including) this datablock
+    if (end > state->nblocks) {
+        end = state->nblocks;
+    }
+
+    uint32_t idx = (state->ra_end > next_idx) ? state->ra_end : next_idx; // skip what's already queued
+    int s = intr_disable();
+    for (; idx < end && ra_head - ra_tail < RA_QUEUE_LEN; idx++) { // drop the rest if the queue is full
+        ra_queue[ra_head % RA_QUEUE_LEN] = datablock_pos(state->inode_blk[1 + idx]);
+        ra_head++;
+    }
+    if (idx > state->ra_end) {
+        state->ra_end = idx;
+    }
+    condition_broadcast(&ra_queued);
+    intr_restore(s);
+}
 
 // Mounts the file system by initializing a global io interface and loading the boot block.
 // @param io - Pointer to the io interface.
 // @return 0 on success, -1 on failure.
 int fs_mount(struct io_intf* io) {
-    lock_init(&kfs_lock, "kfs_lock");
     if (io == NULL) { // If io interface is not valid
         return -1;
     }
-    overall_io = io; // set global io ptr
+    overall_io = bcache_init(&kfs_bcache, io); // set global io ptr to the block cache in front of the device
+    if (overall_io == NULL) {
+        return -1;
+    }
 
     if (ioread_full(overall_io, &boot_block, BLOCK_SIZE) != BLOCK_SIZE) { // If boot block read from storage is not the same length as boot block struct
         return -1;
@@ -35,6 +271,18 @@ int fs_mount(struct io_intf* io) {
     }
 
     memset(files, 0, sizeof(files)); // Initialise files array to all zeros
+    memset(file_states, 0, sizeof(file_states));
+    for (int i = 0; i < MAX_FILES; i++) { // every slot starts free, lowest index on top
+        free_slots[i] = MAX_FILES - 1 - i;
+        lock_init(&file_states[i].lock, "kfs_file_lock"); // once: a late reader may still be waiting on it after a reopen
+    }
+    free_top = MAX_FILES;
+    dentry_index_build(); // index the dentries for fs_open
+
+    if (KFS_RA_MAX > 0) { // start the readahead thread
+        condition_init(&ra_queued, "kfs_ra_queued");
+        thread_spawn("kfs_readahead", readahead_thread_func, NULL);
+    }
 
     return 0;
 }
@@ -50,49 +298,48 @@ int fs_open(const char* name, struct io_intf** io) {
     }
 
 
-    uint32_t no_dentries = boot_block.stats.no_dentries; // Get number of entries
-
-    dentry_t* file_dentry = NULL; // Temporary dentry pointer for the dentry of the file passed to this function
-
-    for(int i = 0; i < no_dentries; i++) { // Iterate through dentries
-        //kprintf("this is the filename: %s\n", boot_block.dentries[i].filename);
-        if(strcmp(boot_block.dentries[i].filename, name) == 0){ // If dentry filename is the same as name passed
-            file_dentry = &boot_block.dentries[i]; // Set temp dentry pointer
-            break;
-        }
-    }
+    dentry_t* file_dentry = dentry_lookup(name); // Dentry of the file passed to this function, via the hash index
     //kprintf("file name found: %s\n", file_dentry->filename);
     if(file_dentry == NULL){ // If there exists no file with that name, return -1 (no file could be opened)
         kprintf("FILE NOT FOUND\n");
         return -1;
     }
 
-    file_t* available_file = NULL; // Set temporary file pointer
-
-    for (int i = 0; i < MAX_FILES; i++) { // Iterate through file array
-        if (!(files[i].flags & FILE_IN_USE)) { // Find if files[i] is in use
-            available_file = &files[i]; // If not, set the file pointer to it and break
-            break;
-        }
-    }
-
-    if (available_file == NULL) { // If there are no available files, return -1 (all file systems are being used)
+    if (free_top == 0) { // If there are no available files, return -1 (all file systems are being used)
         kprintf("NO AVAILABLE FILES\n");
         return -1;
     }
+    int slot = free_slots[--free_top]; // Pop a free file slot before the inode read below can sleep
 
     uint32_t inode_idx = file_dentry->inode_no; // Inode for temp file dentry
     uint64_t inode_offset = BLOCK_SIZE*(inode_idx+1); // offset from overall_io
-    if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &inode_offset) != 0) {
-        kprintf("died at setpos?\n");
+
+    // Pull in the whole inode (byte length + datablock list) with one read so fs_read and
+    // fs_write never have to go back to the device to look up a datablock number.
+    uint32_t* inode_blk = memory_alloc_page();
+    if (ioreadat(overall_io, inode_offset, inode_blk, BLOCK_SIZE) != BLOCK_SIZE) { // Read that dentry's inode into the page
+        kprintf("died at inode?\n");
+        memory_free_page(inode_blk);
+        free_slots[free_top++] = slot;
         return -1;
     }
 
-    uint32_t inode_byte_len; // Inode struct to fill
-    if (ioread_full(overall_io, &inode_byte_len, sizeof(uint32_t)) != sizeof(uint32_t)) { // Read that dentry's inode into the fillable struct
-        kprintf("died at inode?\n");
+    uint32_t inode_byte_len = inode_blk[0]; // first word of the inode is the byte length
+    uint32_t nblocks = (inode_byte_len + BLOCK_SIZE - 1) / BLOCK_SIZE; // datablocks spanned by the file
+    if (nblocks > INODE_MAX_BLOCKS) { // corrupt inode
+        memory_free_page(inode_blk);
+        free_slots[free_top++] = slot;
         return -1;
     }
+    for (uint32_t i = 0; i < nblocks; i++) { // make sure every datablock number is in range
+        if (inode_blk[1 + i] >= boot_block.stats.no_datablocks) {
+            memory_free_page(inode_blk);
+            free_slots[free_top++] = slot;
+            return -1;
+        }
+    }
+
+    file_t* available_file = &files[slot];
 
     static const struct io_ops file_io_ops = { // set the ops struct
         .close = fs_close,
@@ -107,6 +354,12 @@ int fs_open(const char* name, struct io_intf** io) {
     available_file->file_size = inode_byte_len; // Calculate file size in bytes
     available_file->file_pos = 0; // Start at the beginning of the file
     available_file->flags = FILE_IN_USE; // Mark as in use
+    struct file_state* state = &file_states[available_file - files];
+    state->inode_blk = inode_blk; // keep the inode around until close
+    state->nblocks = nblocks;
+    state->ra_next = 0; // reading from the start counts as sequential
+    state->ra_window = 0;
+    state->ra_end = 0;
     *io = &available_file->io; // set pointer to io pointer to the avaiable_file's io pointer
     //kprintf("returns? on file: %s\n", name);
 
@@ -122,14 +375,7 @@ void fs_close(struct io_intf* io) {
         return;
     }
 
-    file_t* file_to_close = NULL; // Temporary file pointer to find the file to close 
-
-    for (int i = 0; i < MAX_FILES; i++) { // iterate through the open files array
-        if (&files[i].io == io && (files[i].flags & FILE_IN_USE)) { // if the file io interfaces match and the file is in use
-            file_to_close = &files[i]; // set the file pointer to that file and break
-            break;
-        }
-    }
+    file_t* file_to_close = io_to_file(io); // File that owns the io interface
 
     if (file_to_close == NULL) { // If there isn't a match (file isn't in the array/isn't open), return -1
         return;
@@ -140,92 +386,101 @@ void fs_close(struct io_intf* io) {
     }
 
     if (io->refcnt == 0) {
+        bcache_flush(&kfs_bcache); // last close: get what was written to the file onto the device
+        struct file_state* state = &file_states[file_to_close - files];
+        int s = intr_disable();
         file_to_close->flags &= ~FILE_IN_USE; // set this file location to not in use
+        int idle = (state->users == 0); // otherwise the last transfer out releases it (file_leave)
+        intr_restore(s);
+        if (idle) {
+            file_release(file_to_close);
+        }
     }
 
     //file_to_close->flags &= ~FILE_IN_USE; // set this file location to not in use
 }
 
 
+// Moves n bytes between buf and a file starting at an explicit file position. Neither file_pos
+// nor the readahead state is touched. Caller is inside file_enter/file_leave, which keeps the cached
+// inode from being freed by a last fs_close in the middle of the transfer.
+// @param file - Open file to transfer to/from.
+// @param pos - File position to start at.
+// @param buf - Buffer to read into (write == 0) or write from (write != 0).
+// @param n - Number of bytes to transfer. Clamped to the end of the file.
+// @param write - Nonzero to write to the file, zero to read from it.
+// @return Number of bytes transferred, -1 on failure.
+static long fs_transfer(file_t* file, uint64_t pos, void* buf, unsigned long n, int write) {
+    if (pos >= file->file_size) { // boundary checking
+        return 0;
+    }
+
+    if (pos + n > file->file_size) {
+        n = file->file_size - pos;
+    }
+
+    const uint32_t* blockmap = file_states[file - files].inode_blk + 1; // datablock numbers, skipping byte_length
+
+    uint64_t bytes_done = 0; // bytes that have been transferred
+    uint64_t remaining = n; // bytes remaining to transfer
+
+    while(remaining > 0) { // ends when there are no more bytes to transfer
+        uint64_t datablock_idx = pos / BLOCK_SIZE; // datablock index calculation
+        uint32_t datablock_offset = pos % BLOCK_SIZE; // position in each datablock
+        uint32_t datablock_no = blockmap[datablock_idx]; // served from the inode cached at open
+
+        uint64_t dev_offset = datablock_pos(datablock_no) + datablock_offset; // offset of whole blocks + datablock position
+        uint64_t bytes_iter = extent_len(blockmap, datablock_idx, datablock_offset, remaining); // bytes in this run of adjacent datablocks
+        long cnt;
+
+        // Positional so concurrent transfers on different files never fight over the device position
+        if (write) {
+            cnt = iowriteat(overall_io, dev_offset, buf + bytes_done, bytes_iter); // write the bytes from the buffer
+        } else {
+            cnt = ioreadat(overall_io, dev_offset, buf + bytes_done, bytes_iter); // read the bytes into the buffer
+        }
+
+        if (cnt != bytes_iter) {
+            return -1;
+        }
+        if (write) { // pages of this file cached for mmap must not go stale
+            memory_mmap_update(file->inode_no, pos, buf + bytes_done, bytes_iter);
+        }
+        bytes_done += bytes_iter; // increment total bytes transferred
+        remaining -= bytes_iter; // decrement bytes remaining
+        pos += bytes_iter; // increment file position
+    }
+
+    return bytes_done;
+}
+
+
 // Writes data to a file starting from its current position (as saved in the file list).
 // @param io - Pointer to the io interface of the file.
 // @param buf - Pointer to the buffer containing data to write.
 // @param n - Number of bytes to write.
 // @return Number of bytes written, -1 on failure.
 long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
-    lock_acquire(&kfs_lock);
     if (io == NULL || buf == NULL) {
         return -1;
     }
 
-    file_t* file_to_write = NULL; // Temporary file pointer to find the file to write to 
-
-    for (int i = 0; i < MAX_FILES; i++) { // iterate through the open files array
-        if (&files[i].io == io && (files[i].flags & FILE_IN_USE)) { // if the file io interfaces match and the file is in use
-            file_to_write = &files[i]; // set the file pointer to that file and break
-            break;
-        }
-    }
+    file_t* file_to_write = io_to_file(io); // File that owns the io interface
 
     if (file_to_write == NULL) { // If there isn't a match (the file to write to isn't open), return -1
         return -1;
     }
 
-    if (file_to_write->file_pos >= file_to_write->file_size) { // boundary checking
-        return 0; 
+    if (file_enter(file_to_write) != 0) { // only writers/readers of this same file wait here
+        return -1;
     }
 
-    if (file_to_write->file_pos + n > file_to_write->file_size) {
-        n = file_to_write->file_size - file_to_write->file_pos;
+    long bytes_written = fs_transfer(file_to_write, file_to_write->file_pos, (void*)buf, n, 1);
+    if (bytes_written > 0) {
+        file_to_write->file_pos += bytes_written; // advance past what was written
     }
 
-    uint32_t inode_idx = file_to_write->inode_no; // Inode for temp file
-    uint64_t inode_offset = BLOCK_SIZE*(inode_idx+1); // offset from overall_io
-    // if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &inode_offset) != 0) { // move overall_io to inode base address
-    //     return -1;
-    // }
-
-    // inode_t inode; // Inode struct to fill
-    // if (ioread_full(overall_io, &inode, sizeof(inode_t)) != sizeof(inode_t)) { // Read that file's inode into the fillable struct
-    //     return -1;
-    // }
-
-    uint64_t bytes_written = 0; // bytes that have been written
-    uint64_t remaining = n; // bytes remaining to write
-    uint64_t file_pos = file_to_write->file_pos; // create a local variable to edit file_pos
-
-    while(remaining > 0) { // ends when there are no more bytes to write 
-        uint64_t datablock_idx = file_pos / BLOCK_SIZE; // datablock index calculation
-        uint32_t datablock_offset = file_pos % BLOCK_SIZE; // position in each datablock
-        uint64_t datablock_entry_offset = inode_offset + sizeof(uint32_t) + datablock_idx * sizeof(uint32_t); // Skip byte_length and locate datablock_nos
-
-        uint32_t datablock_no;
-        if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &datablock_entry_offset) != 0) {
-            return -1;
-        }
-        if (ioread_full(overall_io, &datablock_no, sizeof(datablock_no)) != sizeof(datablock_no)) {
-            return -1;
-        }
-
-        uint64_t offset = (1 + boot_block.stats.no_inodes + datablock_no)*BLOCK_SIZE; // offset of whole blocks
-        uint64_t write_offset = offset + datablock_offset; // offset of whole blocks + datablock position
-
-        uint64_t bytes_to_write_iter = (BLOCK_SIZE - datablock_offset) < remaining ? (BLOCK_SIZE - datablock_offset) : remaining; // ternary operator for how many bytes will be written in this iteration
-
-        if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &write_offset) != 0) { // move the global io pointer to the write offset
-            return -1;
-        }
-
-        if (iowrite(overall_io, buf + bytes_written, bytes_to_write_iter) != bytes_to_write_iter) { // write the bytes from the buffer
-            return -1;
-        }  
-        bytes_written += bytes_to_write_iter; // increment total bytes written
-        remaining -= bytes_to_write_iter; // decrement bytes remaining to write
-        file_pos += bytes_to_write_iter; // increment file position
-    }
-
-    file_to_write->file_pos = file_pos; // set local file position variable to files array struct file position
-    lock_release(&kfs_lock);
+    file_leave(file_to_write);
     return bytes_written; // return bytes written
 }
 
@@ -236,25 +491,23 @@ long fs_write(struct io_intf* io, const void* buf, unsigned long n) {
 // @param n - Number of bytes to read.
 // @return Number of bytes read, -1 on failure.
 long fs_read(struct io_intf* io, void* buf, unsigned long n) {
-    lock_acquire(&kfs_lock);
     if (io == NULL || buf == NULL) {
         return -1;
     }
 
-    file_t* file_to_read = NULL; // Temporary file pointer to find the file to write to 
+    file_t* file_to_read = io_to_file(io); // File that owns the io interface
 
-    for (int i = 0; i < MAX_FILES; i++) { // iterate through the open files array
-        if (&files[i].io == io && (files[i].flags & FILE_IN_USE)) { // if the file io interfaces match and the file is in use
-            file_to_read = &files[i]; // set the file pointer to that file and break
-            break;
-        }
+    if (file_to_read == NULL) { // If there isn't a match (the file to write to isn't open), return -1
+        return -1;
     }
 
-    if (file_to_read == NULL) { // If there isn't a match (the file to write to isn't open), return -1
+    struct file_state* state = &file_states[file_to_read - files];
+    if (file_enter(file_to_read) != 0) { // only writers/readers of this same file wait here
         return -1;
     }
 
     if (file_to_read->file_pos >= file_to_read->file_size) { // boundary checking
+        file_leave(file_to_read);
         return 0;
     }
 
@@ -262,58 +515,17 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
         n = file_to_read->file_size - file_to_read->file_pos;
     }
 
-    uint32_t inode_idx = file_to_read->inode_no; // Inode for temp file
-    uint64_t inode_offset = BLOCK_SIZE*(inode_idx+1); // offset from overall_io
-    // if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &inode_offset) != 0) {
-    //     return -1;
-    // }
-
-    // inode_t inode; // Inode struct to fill
-    // if (ioread_full(overall_io, &inode, sizeof(inode_t)) != sizeof(inode_t)) { // Read that file's inode into the fillable struct
-    //     return -1;
-    // }
-
-    uint64_t bytes_read = 0; // bytes that have been read
-    uint64_t remaining = n; // bytes remaining to read
-    uint64_t file_pos = file_to_read->file_pos; // create a local variable to edit file_pos
-
-    while(remaining > 0) { // ends when there are no more bytes to write
-       uint64_t datablock_idx = file_pos / BLOCK_SIZE; // datablock index calculation
-        uint32_t datablock_offset = file_pos % BLOCK_SIZE; // position in each datablock
-        uint64_t datablock_entry_offset = inode_offset + sizeof(uint32_t) + datablock_idx * sizeof(uint32_t); // Skip byte_length and locate datablock_nos
-
-        uint32_t datablock_no;
-        if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &datablock_entry_offset) != 0) {
-            return -1;
-        }
-        if (ioread_full(overall_io, &datablock_no, sizeof(datablock_no)) != sizeof(datablock_no)) {
-            return -1;
-        }
-
-        uint64_t offset = (1 + boot_block.stats.no_inodes + datablock_no)*BLOCK_SIZE; // offset of whole blocks
-        uint64_t read_offset = offset + datablock_offset; // offset of whole blocks + datablock position
-
-
-        uint64_t bytes_to_read_iter = (BLOCK_SIZE - datablock_offset) < remaining ? (BLOCK_SIZE - datablock_offset) : remaining; // ternary operator for how many bytes will be read in this iteration
-
-        if (overall_io->ops->ctl(overall_io, IOCTL_SETPOS, &read_offset) != 0) { // move the global io pointer to the write offset
-            return -1;
-        }
-
-        if (ioread_full(overall_io, buf + bytes_read, bytes_to_read_iter) != bytes_to_read_iter) {  // write the bytes to the buffer
-            return -1;
-        }  
-        bytes_read += bytes_to_read_iter; // increment total bytes written
-        remaining -= bytes_to_read_iter; // decrement bytes remaining to write
-        file_pos += bytes_to_read_iter; // increment file position
+    if (KFS_RA_MAX > 0 && n > 0) {
+        readahead(state, file_to_read->file_pos, n); // get the next datablocks coming
     }
 
+    long bytes_read = fs_transfer(file_to_read, file_to_read->file_pos, buf, n, 0);
+    if (bytes_read > 0) {
+        file_to_read->file_pos += bytes_read; // advance past what was read
+    }
 
-    file_to_read->file_pos = file_pos; // set local file position variable to files array struct file position
-    lock_release(&kfs_lock);
-    return bytes_read; // return bytes written
-
-
+    file_leave(file_to_read);
+    return bytes_read; // return bytes read
 }
 
 
@@ -325,20 +537,21 @@ long fs_read(struct io_intf* io, void* buf, unsigned long n) {
 int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
 
     int ret = -1;
-    if (io == NULL || arg == NULL) {
+    if (io == NULL) {
         return -1;
     }
 
-    file_t* available_file = NULL; // Set temporary file pointer
+    file_t* available_file = io_to_file(io); // File that owns the io interface
 
-    for (int i = 0; i < MAX_FILES; i++) { // Iterate through file array
-        if (&files[i].io == io && (files[i].flags & FILE_IN_USE)) { // Find if files[i] is in use
-            available_file = &files[i]; // If not, set the file pointer to it and break
-            break;
-        }
+    if (available_file == NULL) { // If there are no available files, return -1 (all file systems are being used)
+        return -1;
     }
 
-    if (available_file == NULL) { // If there are no available files, return -1 (all file systems are being used)
+    if (cmd == IOCTL_FLUSH) { // the only command without an argument
+        return bcache_flush(&kfs_bcache); // dirty blocks aren't tracked per file, so this writes back all of them
+    }
+
+    if (arg == NULL) {
         return -1;
     }
 
@@ -347,11 +560,28 @@ int fs_ioctl(struct io_intf* io, int cmd, void* arg) {
     } else if(cmd == IOCTL_GETPOS) {
         ret = fs_getpos(available_file, arg);
     } else if(cmd == IOCTL_SETPOS) {
-        lock_acquire(&kfs_lock);
-        ret = fs_setpos(available_file, arg);
-        lock_release(&kfs_lock);
+        ret = file_enter(available_file);
+        if (ret == 0) {
+            ret = fs_setpos(available_file, arg);
+            file_leave(available_file);
+        }
     } else if(cmd == IOCTL_GETBLKSZ) {
         ret = fs_getblksz(available_file, arg);
+    } else if(cmd == IOCTL_GETINO) {
+        *(uint64_t*)arg = available_file->inode_no; // the inode is what identifies a file in kfs
+        ret = 0;
+    } else if(cmd == IOCTL_READAT || cmd == IOCTL_WRITEAT) {
+        struct io_posrw* rw = arg;
+        unsigned long len = (rw->len > INT_MAX) ? INT_MAX : rw->len; // count has to fit the return value
+
+        if (cmd == IOCTL_READAT && memory_prepare_user_write(rw->buf, len) != 0) { // copy-on-write pages get copied first
+            return -1;
+        }
+        ret = file_enter(available_file); // keeps the inode around for the whole transfer
+        if (ret == 0) {
+            ret = fs_transfer(available_file, rw->pos, rw->buf, len, cmd == IOCTL_WRITEAT);
+            file_leave(available_file);
+        }
     }
 
     return ret;
@@ -20,6 +20,8 @@
 struct lock {
     struct condition cond;
     int tid; // thread holding lock or -1
+    unsigned int next_ticket; // ticket handed to the next thread that calls lock_acquire
+    unsigned int now_serving; // ticket allowed to take the lock next
 };
 
 static inline void lock_init(struct lock * lk, const char * name);
@@ -33,17 +35,23 @@ static inline void lock_init(struct lock * lk, const char * name) {
     trace("%s(<%s:%p>", __func__, name, lk);
     condition_init(&lk->cond, name);
     lk->tid = -1;
+    lk->next_ticket = 0;
+    lk->now_serving = 0;
 }
 
 // Function: lock_acquire
 // Description: Acquires a lock for the currently running thread. If the lock is already held
 //              by another thread, the calling thread will wait until the lock becomes available.
+//              Waiters are granted the lock in the order they arrived (ticket order), so a
+//              thread that keeps re-acquiring the lock can't starve the others.
 // Parameters:
 //   - lk: Pointer to the lock structure to be acquired.
 static inline void lock_acquire(struct lock * lk) {
-    // TODO: FIXME implement this
+    unsigned int ticket;
+
     intr_disable(); // disable interrupts
-    while (lk->tid != -1) 
+    ticket = lk->next_ticket++; // take a place in line
+    while (lk->tid != -1 || lk->now_serving != ticket) 
         condition_wait(&lk->cond); // wait until the lock condition is broadcasted
     lk->tid = running_thread(); // set the locked thread to running
     intr_enable(); // enable interrupts
@@ -55,6 +63,7 @@ static inline void lock_release(struct lock * lk) {
     assert (lk->tid == running_thread());
     
     lk->tid = -1;
+    lk->now_serving++; // hand the lock to the next ticket in line
     condition_broadcast(&lk->cond);
 
     debug("Thread <%s:%d> released lock <%s:%p>",
@@ -24,11 +24,26 @@
 #include "error.h"
 #include "thread.h"
 #include "process.h"
+#include "ioext.h"
+#include "slab.h"
 
 #include <stdint.h>
 
 #define TOT_LEVELS 2
 
+// Number of mmap regions across all memory spaces, and of buckets in the hash
+// table of the mmap page cache.
+#define MMAP_REGION_MAX 16
+#define MMAP_HASH_SIZE 64
+
+// Block orders of the physical page allocator: a block of order k is 2^k
+// physically contiguous pages, aligned to its size. Order 9 is a megapage.
+#define MEMORY_NORDER 10
+
+// Most ASIDs handed out to memory spaces at once (fewer if the hart implements
+// fewer). ASID 0 belongs to the main memory space.
+#define MEMORY_NASID 256
+
 // EXPORTED VARIABLE DEFINITIONS
 //
 
@@ -53,9 +68,12 @@ extern char _kimg_end[];
 //
 
 union linked_page {
-    union linked_page * next;
+    struct {
+        union linked_page * next;
+        union linked_page * prev; // so a block can be taken out when its buddy is freed
+    };
     char padding[PAGE_SIZE];
-}; //a page of memory that we store in the linked lists
+}; //a page of memory that we store in the linked lists, the first page of a free block
 
 struct pte { //64 bit number with all the page table entry data and shi
     uint64_t flags:8; //these are like another way to do a bitshift 
@@ -66,6 +84,32 @@ struct pte { //64 bit number with all the page table entry data and shi
     uint64_t n:1;
 };
 
+// A file mapped into a user memory space by memory_mmap. Pages are only read
+// in from the file when they're first touched.
+
+struct mmap_region {
+    struct pte * root; // root page table of the memory space, NULL if unused
+    uintptr_t start; // first vma of the region (page aligned)
+    size_t size; // length of the region in bytes (page multiple)
+    struct io_intf * io; // file backing the region, we hold a reference to it
+    uint64_t ino; // identifies the file so its pages can be shared
+    uint64_t off; // file offset mapped at start (page aligned)
+};
+
+// A clean file page in the mmap page cache. The number of PTEs mapping it is
+// kept in page_refcnt; a page nothing maps anymore stays cached until the page
+// allocator runs out and evicts it (mmap_evict), so the cache grows and shrinks
+// with free memory.
+
+struct mmap_page {
+    struct mmap_page * hnext; // next entry in the same hash bucket
+    struct mmap_page * lru_next; // toward the most recently faulted on
+    struct mmap_page * lru_prev;
+    void * page; // the physical page
+    uint64_t ino; // file the page came from
+    uint64_t pgoff; // page index within the file
+};
+
 // INTERNAL MACRO DEFINITIONS
 //
 
@@ -74,6 +118,21 @@ struct pte { //64 bit number with all the page table entry data and shi
 #define VPN0(vma) (((vma) >> 12) & 0x1FF)
 #define MIN(a,b) (((a)<(b))?(a):(b))
 
+// Value of the PTE rsw field for a leaf that maps a page owned by the mmap
+// page cache. These pages are dropped with mmap_page_put, never freed directly.
+#define PTE_RSW_MMAP 1
+
+// Values of the PTE rsw field for a user leaf whose page memory_space_clone left
+// shared between memory spaces. Such a page has a reference count (page_refcnt)
+// and is dropped with cow_page_put. COW pages were writable and get copied on
+// the first store (cow_page_break); SHARED ones were read-only and stay shared.
+#define PTE_RSW_COW 2
+#define PTE_RSW_SHARED 3
+
+// ASID field of a memory space tag (satp value)
+#define MTAG_ASID_MASK \
+    ((((uintptr_t)1 << RISCV_SATP_ASID_nbits) - 1) << RISCV_SATP_ASID_shift)
+
 // INTERNAL FUNCTION DECLARATIONS
 //
 
@@ -104,11 +163,71 @@ static inline struct pte ptab_pte (
 static inline struct pte null_pte(void);
 
 static inline void sfence_vma(void);
+static inline void sfence_vma_page(uintptr_t vma);
+static inline void sfence_vma_space(void);
+static inline uint_fast16_t mtag_to_asid(uintptr_t mtag);
+
+static uint_fast16_t asid_alloc(const struct pte * root);
+static void asid_release(uintptr_t mtag);
+
+static struct mmap_region * mmap_find(const struct pte * root, uintptr_t vma);
+static void * mmap_page_get(const struct mmap_region * rgn, uint64_t pgoff);
+static void mmap_page_ref(const void * page);
+static void mmap_page_put(const void * page);
+static void mmap_release_space(const struct pte * root);
+static inline size_t mmap_hash_of(uint64_t ino, uint64_t pgoff);
+static struct mmap_page * mmap_page_find(uint64_t ino, uint64_t pgoff);
+static void mmap_lru_append(struct mmap_page * mp);
+static void mmap_lru_remove(struct mmap_page * mp);
+static void mmap_page_drop(struct mmap_page * mp);
+static int mmap_evict(void);
+
+static inline size_t page_index(const void * pp);
+static void free_area_push(union linked_page * blk, unsigned int order);
+static void free_area_remove(union linked_page * blk, unsigned int order);
+static void * pool_carve(unsigned int order);
+
+static inline uint16_t * page_refcnt_of(const void * pp);
+static void cow_page_break(struct pte * pte);
+static void cow_page_put(void * pp);
 
 // INTERNAL GLOBAL VARIABLES
 //
 
-static union linked_page * free_list;
+// Buddy allocator state: a list of free blocks for each order, how many blocks
+// each list holds, and for each page of RAM one more than the order of the free
+// block it starts (0 if it doesn't start one, so the table starts out right).
+// The lists only hold pages that were handed out and given back; pages from
+// pool_next up to RAM_END haven't been handed out yet and are carved off as
+// needed (pool_carve), so nothing has to walk all of RAM at boot.
+static union linked_page * free_area[MEMORY_NORDER];
+static size_t free_cnt[MEMORY_NORDER];
+static uint8_t free_order[RAM_SIZE / PAGE_SIZE];
+static void * pool_next;
+
+static struct mmap_region mmap_regions[MMAP_REGION_MAX];
+
+// mmap page cache: entries hashed by (ino, pgoff), and every entry on a list
+// in the order pages were last faulted on, which eviction goes through
+// oldest first.
+static struct mmap_page * mmap_hash[MMAP_HASH_SIZE];
+static struct mmap_page * mmap_lru_head;
+static struct mmap_page * mmap_lru_tail;
+static struct slab_cache mmap_page_cache =
+    SLAB_CACHE_INITIALIZER("mmap page", sizeof(struct mmap_page), NULL);
+
+// Number of PTEs mapping each physical page of RAM, kept only for pages mapped
+// with PTE_RSW_COW, PTE_RSW_SHARED or PTE_RSW_MMAP (0 for everything else).
+static uint16_t page_refcnt[RAM_SIZE / PAGE_SIZE];
+
+// ASID allocator state. asid_root[a] is the root page table of the memory space
+// ASID a is handed to in the current generation (NULL if none). ASIDs are handed
+// out in order and not reused within a generation; when they run out, a new
+// generation starts with a full TLB flush, and memory spaces that lost their
+// ASID get a new one the next time they're switched to (memory_space_activate).
+static const struct pte * asid_root[MEMORY_NASID];
+static uint_fast16_t asid_max; // highest ASID usable, 0 if the hart has none
+static uint_fast16_t asid_next;
 
 static struct pte main_pt2[PTE_CNT]
     __attribute__ ((section(".bss.pagetable"), aligned(4096)));
@@ -210,6 +329,16 @@ void memory_init(void) {
     csrw_satp(main_mtag);
     sfence_vma();
 
+    // Find out how many ASID bits the hart implements: the ones that stick when
+    // all of them are written.
+
+    csrw_satp(main_mtag | MTAG_ASID_MASK);
+    asid_max = mtag_to_asid(csrr_satp());
+    csrw_satp(main_mtag);
+    if (asid_max > MEMORY_NASID - 1)
+        asid_max = MEMORY_NASID - 1;
+    asid_next = 1;
+
     // Give the memory between the end of the kernel image and the next page
     // boundary to the heap allocator, but make sure it is at least
     // HEAP_INIT_MIN bytes.
@@ -231,18 +360,14 @@ void memory_init(void) {
     kprintf("\nHeap allocator: [%p,%p): %zu KB free\n",
         heap_start, heap_end, (heap_end - heap_start) / 1024);
 
-    free_list = heap_end; // heap_end is page aligned
-    page_cnt = (RAM_END - heap_end) / PAGE_SIZE;
+    page_cnt = (RAM_END - heap_end) / PAGE_SIZE; // heap_end is page aligned
 
     kprintf("Page allocator: [%p,%p): %lu pages free\n",
-        free_list, RAM_END, page_cnt);
+        heap_end, RAM_END, page_cnt);
 
-    // Put free pages on the free page list
-    // TODO: FIXME implement this (must work with your implementation of
-    // memory_alloc_page and memory_free_page).
-    for(pp = free_list; pp < (void*)RAM_END; pp+=PAGE_SIZE){
-        memory_free_page((void*)pp); //add all the available physical memory into free list
-    }
+    // The free pages aren't touched here: they form the pool that
+    // memory_alloc_pages carves blocks off when the free lists run dry.
+    pool_next = heap_end;
     
     // Allow supervisor to access user memory. We could be more precise by only
     // enabling it when we are accessing user memory, and disable it at other
@@ -350,6 +475,24 @@ static inline void sfence_vma(void) {
     asm inline ("sfence.vma" ::: "memory");
 }
 
+// Flushes the TLB entries for the page at vma in the active memory space only.
+// Global (kernel) mappings aren't touched.
+static inline void sfence_vma_page(uintptr_t vma) {
+    const uintptr_t asid = mtag_to_asid(active_space_mtag());
+    asm inline ("sfence.vma %0, %1" :: "r"(vma), "r"(asid) : "memory");
+}
+
+// Flushes all TLB entries of the active memory space, leaving other spaces' and
+// global (kernel) mappings alone.
+static inline void sfence_vma_space(void) {
+    const uintptr_t asid = mtag_to_asid(active_space_mtag());
+    asm inline ("sfence.vma zero, %0" :: "r"(asid) : "memory");
+}
+
+static inline uint_fast16_t mtag_to_asid(uintptr_t mtag) {
+    return (mtag & MTAG_ASID_MASK) >> RISCV_SATP_ASID_shift;
+}
+
 // uintptr_t memory_space_create(void)
 // Creates a new memory space and makes it the currently active space. Returns a
 // memory space tag (type uintptr_t) that may be used to refer to the memory
@@ -357,7 +500,7 @@ static inline void sfence_vma(void) {
 // address space and RAM as the main memory space. This function never fails; if
 // there are not enough physical memory pages to create the new memory space, it
 // panics.
-//@params: uint_fast16_t asid: address space id used to identify a virtual memory space
+//@params: uint_fast16_t asid: address space id used to identify a virtual memory space, 0 to get one from the ASID allocator
 //@returns: uintptr_t satrKey: it returns a pointer to the memory space tag that we have just switched to!!
 
 uintptr_t memory_space_create(uint_fast16_t asid){
@@ -366,6 +509,9 @@ uintptr_t memory_space_create(uint_fast16_t asid){
     for(size_t i = 0; i< PTE_CNT; i++){
         petah[i] = main_pt2[i]; //copy kernel diagnostics
     }
+    if (asid == 0) {
+        asid = asid_alloc(petah); //fresh ASID, so no stale TLB entries to flush
+    }
     //we need to write into satp which has the following format: Base = SV address type(in our case its SV39), ASID = the fookin thing that was passed in, Physical Page number (PPN) of physical memory address 
     uintptr_t satrKey = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift    |    (uintptr_t)asid << RISCV_SATP_ASID_shift     |    pageptr_to_pagenum(petah));
     memory_space_switch(satrKey); //switch to the next memory space
@@ -385,29 +531,132 @@ void memory_space_reclaim(void) {
         return; //no need to do anything if already in main memory space
     }
 
-    memory_unmap_and_free_user(); // Reclaim all user-space mappings
-    memory_free_page(mtag_to_root(old_mtag)); // Free root page table if not main
+    memory_unmap_and_free_user(); // Reclaim all user-space mappings (and their TLB entries)
 
     // Switch back to main memory space
     csrw_satp(main_mtag);
-    sfence_vma(); //flush the TLB
+    asid_release(old_mtag); // nothing uses the ASID anymore
+    memory_free_page(mtag_to_root(old_mtag)); // Free root page table if not main
 }
 
+// uintptr_t memory_space_activate(uintptr_t * mtagp)
+// Switches to the memory space *mtagp, like memory_space_switch. The TLB is not
+// flushed: entries are tagged with the space's ASID, so the ones it left behind
+// are still good and other spaces' can't be mistaken for its own. If the space
+// lost its ASID to an ASID rollover since it last ran, it gets a new one first
+// and *mtagp is updated. Without hardware ASIDs every switch flushes the TLB.
+//@param: uintptr_t* mtagp: tag of the space to switch to, e.g. &proc->mtag
+//@return: the tag of the memory space that was active before
+
+uintptr_t memory_space_activate(uintptr_t * mtagp) {
+    uintptr_t mtag = *mtagp;
+    uintptr_t prev;
+
+    if (mtag != main_mtag && asid_max != 0) {
+        const struct pte *root = mtag_to_root(mtag);
+        if (asid_root[mtag_to_asid(mtag)] != root) { //handed to someone else, or never assigned
+            mtag = (mtag & ~MTAG_ASID_MASK) |
+                ((uintptr_t)asid_alloc(root) << RISCV_SATP_ASID_shift);
+            *mtagp = mtag;
+        }
+    }
+
+    prev = memory_space_switch(mtag);
+    if (asid_max == 0 && prev != mtag) {
+        sfence_vma(); //every space is ASID 0
+    }
+    return prev;
+}
+
+
+// void * memory_alloc_pages(unsigned int order)
+// Allocates 2^order physically contiguous pages, aligned to their size (e.g. for
+// a DMA buffer or, at order 9, a megapage). Takes the smallest free block that is
+// big enough and splits it in halves down to the requested order, putting the
+// unused halves back on the free lists; if there is none, the block comes out of
+// the pool of pages never handed out yet. Returns a pointer to the direct-mapped
+// address of the first page. When neither has a block, file pages nothing maps
+// are evicted from the mmap page cache until one frees up. Does not fail; panics
+// if no block is big enough even then.
+//@param: unsigned int order: log2 of the number of pages, below MEMORY_NORDER
+//@return: the first page of the block
+
+void * memory_alloc_pages(unsigned int order){
+    unsigned int k;
+    union linked_page *blk;
+
+    if (order >= MEMORY_NORDER) {
+        panic("memory_alloc_pages: order too large");
+    }
+    for (;;) {
+        k = order;
+        while (k < MEMORY_NORDER && free_area[k] == NULL) {
+            k++; //find the smallest free block that's big enough
+        }
+        if (k < MEMORY_NORDER) {
+            break;
+        }
+        blk = pool_carve(order);
+        if (blk != NULL) {
+            return (void*) blk;
+        }
+        if (!mmap_evict()) {
+            panic("No free pages available");
+        }
+    }
+
+    blk = free_area[k];
+    free_area_remove(blk, k);
+    while (k > order) { //keep the lower half, free the upper one
+        k--;
+        free_area_push((union linked_page *)((char *)blk + (PAGE_SIZE << k)), k);
+    }
+    return (void*) blk;
+}
+
+// void memory_free_pages(void * pp, unsigned int order)
+// Returns a block of 2^order pages allocated by memory_alloc_pages with the same
+// order to the allocator. While the block's buddy (the other half of the block of
+// the next order up) is free as well, the two are merged.
+//@param: void* pp: first page of the block
+//@param: unsigned int order: order it was allocated with
+
+void memory_free_pages(void * pp, unsigned int order){
+    void *heap_start = _kimg_end; //get the heap start location
+    void* heap_end = round_up_ptr(heap_start, PAGE_SIZE); //get the end of the heap
+    if(order >= MEMORY_NORDER || !(pp >= heap_end && pp + (PAGE_SIZE << order) <= (void*)RAM_END) ||
+        page_index(pp) % (1UL << order) != 0){
+        panic("Not a previously allocated pointer from memory_alloc_page");
+    }
+
+    while (order < MEMORY_NORDER - 1) {
+        //buddy: flip the bit for this order in the page index (RAM_START is megapage aligned)
+        size_t buddy = page_index(pp) ^ (1UL << order);
+        if (buddy >= RAM_SIZE / PAGE_SIZE || free_order[buddy] != order + 1) {
+            break; //buddy is (partly) allocated, or part of the kernel image or heap
+        }
+        free_area_remove((union linked_page *)(RAM_START + buddy * PAGE_SIZE), order);
+        pp = RAM_START + (page_index(pp) & ~(1UL << order)) * PAGE_SIZE; //merged block starts at the lower one
+        order++;
+    }
+    free_area_push((union linked_page *)pp, order);
+}
+
+// size_t memory_free_count(unsigned int order)
+// Returns the number of free blocks of 2^order pages on the physical page
+// allocator's free lists (0 for an order it doesn't have). Pages that were never
+// handed out yet aren't counted.
+
+size_t memory_free_count(unsigned int order){
+    return (order < MEMORY_NORDER) ? free_cnt[order] : 0;
+}
 
 // void * memory_alloc_page(void)
 // Allocates a physical page of memory. Returns a pointer to the direct-mapped
 // address of the page. Does not fail; panics if there are no free pages available.
 
 void * memory_alloc_page(void){
-    if(free_list == NULL){
-        panic("No free pages available");
-        //process_exit();
-    }
-    union linked_page *addr = free_list; //literally just return the pointer at the top of the free list
-    if(free_list->next != NULL){
-        free_list = free_list->next; //and then obviously just move the head
-    }
-    return (void*) addr;
+    return memory_alloc_pages(0);
 }
 
 // void memory_free_page(void * ptr)
@@ -415,14 +664,7 @@ void * memory_alloc_page(void){
 // have been previously allocated by memory_alloc_page.
 
 void memory_free_page(void * pp){
-    void *heap_start = _kimg_end; //get the heap start location
-    void* heap_end = round_up_ptr(heap_start, PAGE_SIZE); //get the end of the heap
-    if(!(pp >= heap_end && pp < (void*)RAM_END)){
-        panic("Not a previously allocated pointer from memory_alloc_page");
-    }
-    union linked_page* ppLink= (union linked_page*) pp; //type cast to union linked_page
-    ppLink->next = free_list; //push the new page to the front of the free list (doesnt have to be front but just has to be in the list i guess)
-    free_list = ppLink; //update the head
+    memory_free_pages(pp, 0);
 }
 
 
@@ -498,7 +740,7 @@ void * memory_alloc_and_map_page (uintptr_t vma, uint_fast8_t rwxug_flags){
     petah->flags |= jit.flags; //add the correct flags
     petah->ppn |= jit.ppn; //add the correct ppn
     //kprintf("Mapped VMA %p to physical page %p with flags %x\n", (void*)vma, peepee, jit.flags);
-    sfence_vma();
+    sfence_vma_page(vma);
     return (void*) vma;
 
 }
@@ -578,7 +820,12 @@ void memory_unmap_and_free_user(void) {
                         if (!wellformed_vptr(pp)) {
                             panic("Invalid physical page pointer");
                         }
-                        memory_free_page(pp);
+                        if (pt0[j].rsw == PTE_RSW_MMAP)
+                            mmap_page_put(pp); // shared file page, drop our reference
+                        else if (pt0[j].rsw == PTE_RSW_COW || pt0[j].rsw == PTE_RSW_SHARED)
+                            cow_page_put(pp); // still shared with a forked space
+                        else
+                            memory_free_page(pp);
                     }
                     // Clear the valid flag for the PTE
                     pt0[j].flags &= ~PTE_V;
@@ -595,8 +842,10 @@ void memory_unmap_and_free_user(void) {
 
 
 
-    // Flush the TLB to remove stale entries
-    sfence_vma();
+    mmap_release_space(pt2); // the mappings are gone, so are the regions
+
+    // Flush the TLB to remove stale entries (only this space's)
+    sfence_vma_space();
 }
 
 
@@ -636,16 +885,88 @@ void memory_set_range_flags(const void *vp, size_t size, uint_fast8_t rwxug_flag
 
         // Update the flags in the page table entry
         pte->flags = (pte->flags & ~(PTE_R | PTE_W | PTE_X | PTE_U | PTE_G)) | rwxug_flags | PTE_V | PTE_A | PTE_D; //add the correct flags (clear first then add the rwxug flags)
+        if (pte->rsw == PTE_RSW_COW || pte->rsw == PTE_RSW_SHARED) {
+            //a shared page stays read-only; if it's meant to be writable the first store copies it
+            pte->rsw = (rwxug_flags & PTE_W) ? PTE_RSW_COW : PTE_RSW_SHARED;
+            pte->flags &= ~PTE_W;
+        }
         //kprintf("Updated PTE for VMA %p with flags %x\n", (void *)vma, pte->flags);
     }
 
-    // Flush the TLB after modifying all relevant PTEs
-    sfence_vma();
+    // Flush the TLB after modifying all relevant PTEs (only this space's)
+    sfence_vma_space();
     //kprintf("Completed flag update for range [%p, %p) with flags %x\n", vp, (void *)end_vma, rwxug_flags);
 }
 
 
 
+// uintptr_t memory_translate(const void * vp, uint_fast8_t rwxug_flags)
+// Translates a virtual address in the active memory space to the physical
+// address it maps to, e.g. to hand a buffer straight to a device. Kernel
+// addresses are direct-mapped and translate to themselves. A user address only
+// translates if its page is mapped with at least /rwxug_flags/ (so a device
+// can't be told to write into a page the process couldn't write itself).
+//@param: const void* vp: virtual address to translate
+//@param: uint_fast8_t rwxug_flags: flags the user page has to be mapped with
+//@return: the physical address, or 0 if vp isn't mapped (yet) with those flags
+uintptr_t memory_translate(const void *vp, uint_fast8_t rwxug_flags) {
+    uintptr_t vma = (uintptr_t)vp;
+
+    if (vma < USER_START_VMA) { //kernel half: identity mapped
+        return vma;
+    }
+    if (vma >= USER_END_VMA) {
+        return 0;
+    }
+
+    struct pte *pte = walk_pt(active_space_root(), round_down_addr(vma, PAGE_SIZE), 0); //don't create anything
+    if (pte == NULL || !(pte->flags & PTE_V) || (pte->flags & (rwxug_flags | PTE_U)) != (rwxug_flags | PTE_U)) {
+        return 0; //not mapped, or lazily allocated and not touched yet
+    }
+
+    return (uintptr_t)pagenum_to_pageptr(pte->ppn) + vma % PAGE_SIZE;
+}
+
+// int memory_prepare_user_write(void * buf, size_t len)
+// Gets the user pages behind a buffer ready for the kernel to store into, e.g.
+// when a file is read into memory a process passed in. Stores from S mode to
+// these pages would fault like the process's own stores do, but the kernel
+// can't take those faults, so their work is done up front: copy-on-write pages
+// get copied (cow_page_break) and pages not touched yet are allocated. Kernel
+// addresses are left alone.
+//@param: void* buf: start of the buffer
+//@param: size_t len: length of the buffer in bytes
+//@return: 0 if the kernel can store to the whole buffer now, -EINVAL if part of
+//         it is outside user memory, a mapped file, or read-only
+int memory_prepare_user_write(void *buf, size_t len) {
+    struct pte *root = active_space_root();
+    uintptr_t start = (uintptr_t)buf;
+
+    if (len == 0 || start < USER_START_VMA) { //kernel half: always writable
+        return 0;
+    }
+    if (start >= USER_END_VMA || len > USER_END_VMA - start) {
+        return -EINVAL;
+    }
+
+    for (uintptr_t vma = round_down_addr(start, PAGE_SIZE); vma < start + len; vma += PAGE_SIZE) {
+        struct pte *pte = walk_pt(root, vma, 0);
+        if (pte == NULL || !(pte->flags & PTE_V)) {
+            if (mmap_find(root, vma) != NULL) {
+                return -EINVAL; //mapped files are read-only
+            }
+            pte = walk_pt(root, vma, 1); //lazily allocated page, as the fault would
+            *pte = leaf_pte(memory_alloc_page(), PTE_R | PTE_W | PTE_U);
+        } else if (pte->rsw == PTE_RSW_COW) {
+            cow_page_break(pte);
+        } else if ((pte->flags & (PTE_W | PTE_U)) != (PTE_W | PTE_U)) {
+            return -EINVAL;
+        }
+        sfence_vma_page(vma);
+    }
+    return 0;
+}
+
 // int memory_validate_vptr_len (
 //     const void * vp, size_t len, uint_fast8_t rwxug_flags);
 // Checks if a virtual address range is mapped with specified flags. Returns 1
@@ -677,7 +998,8 @@ int inRange(const void* vptr){
 
 // void memory_handle_page_fault (
 //      const void *vptr)
-// Handles store, load, and instruction page faults at unallocated pages (lazy allocation)
+// Handles store, load, and instruction page faults at unallocated pages (lazy allocation),
+// and stores to copy-on-write pages left shared by memory_space_clone
 //@param: const void* vptr: starting virtual address of the fault
 //@return: returns nothing
 void memory_handle_page_fault(const void *vptr) {
@@ -691,26 +1013,143 @@ void memory_handle_page_fault(const void *vptr) {
     kprintf("Handling page fault for vaddr: %p\n", vptr);
 
     struct pte *pte = walk_pt(active_space_root(), vma, 1); //get the associated level 2 pte of the associated vma 
+    struct mmap_region *rgn = mmap_find(active_space_root(), vma); //is this part of a mapped file?
+
     if (pte->flags & PTE_V) { //if the pte has a valid flag checked then we don't need to alloc anything
+        if (pte->rsw == PTE_RSW_COW) { //store to a page shared since fork, get our own copy
+            cow_page_break(pte);
+            sfence_vma_page(vma);
+            return;
+        }
+        if (rgn != NULL) { //mapped files are read-only, so this is a store to one
+            kprintf("Write to read-only file mapping at %p\n", vptr);
+            process_exit();
+        }
+        if (pte->rsw == PTE_RSW_SHARED) { //read-only page shared since fork
+            kprintf("Write to read-only page at %p\n", vptr);
+            process_exit();
+        }
         kprintf("PTE already valid for VMA %p (flags=%x)\n", (void *)vma, pte->flags);
         panic("page already mapped");
+    } else if (rgn != NULL) {
+        //fill the page from the file (or share it if another space already did)
+        void *page = mmap_page_get(rgn, (rgn->off + (vma - rgn->start)) / PAGE_SIZE);
+        if (page == NULL) {
+            kprintf("Could not read file page for VMA %p\n", (void *)vma);
+            process_exit();
+        }
+        *pte = leaf_pte(page, PTE_R | PTE_U); //read-only, so a store to it faults
+        pte->rsw = PTE_RSW_MMAP;
     } else {
         void *page = memory_alloc_page(); //create the correct associated page
         *pte = leaf_pte(page, PTE_R | PTE_W | PTE_U | PTE_A | PTE_D | PTE_V); //format the pte to be a leaf pte 
         kprintf("Mapped new page for VMA %p to physical page %p\n", (void *)vma, page);
     }
 
-    sfence_vma(); // Flush TLB
+    sfence_vma_page(vma); // Flush TLB entry for this page
+}
+
+
+// int memory_mmap (
+//      uintptr_t vma, size_t size, struct io_intf * io, uint64_t off)
+// Maps /size/ bytes of the file /io/ starting at file offset /off/ read-only
+// into the active memory space at /vma/. Nothing is read here: pages are filled
+// from the file by memory_handle_page_fault the first time they're touched, and
+// bytes past the end of the file read as zero. The region keeps a reference to
+// /io/ until the memory space goes away.
+//@param: uintptr_t vma: page-aligned user address to map the file at
+//@param: size_t size: length of the mapping, rounded up to whole pages
+//@param: struct io_intf* io: the file to map (it has to answer IOCTL_GETINO)
+//@param: uint64_t off: page-aligned offset in the file the mapping starts at
+//@return: 0 on success, negative error code otherwise
+int memory_mmap(uintptr_t vma, size_t size, struct io_intf *io, uint64_t off) {
+    struct pte *root = active_space_root();
+    struct mmap_region *rgn = NULL;
+    uint64_t ino;
+
+    if (io == NULL || size == 0 || !aligned_addr(vma, PAGE_SIZE) || off % PAGE_SIZE != 0) {
+        return -EINVAL;
+    }
+    size = round_up_size(size, PAGE_SIZE);
+    if (vma < USER_START_VMA || vma + size > USER_END_VMA || vma + size < vma) {
+        return -EINVAL; //the whole range has to be user memory
+    }
+    if (ioctl(io, IOCTL_GETINO, &ino) != 0) {
+        return -ENOTSUP; //only files have something to share pages by
+    }
+
+    for (uintptr_t a = vma; a < vma + size; a += PAGE_SIZE) {
+        struct pte *pte = walk_pt(root, a, 0);
+        if ((pte != NULL && (pte->flags & PTE_V)) || mmap_find(root, a) != NULL) {
+            return -EBUSY; //don't map over anything that's already there
+        }
+    }
+
+    for (int i = 0; i < MMAP_REGION_MAX; i++) {
+        if (mmap_regions[i].root == NULL) {
+            rgn = &mmap_regions[i];
+            break;
+        }
+    }
+    if (rgn == NULL) {
+        return -ENOMEM;
+    }
+
+    rgn->root = root;
+    rgn->start = vma;
+    rgn->size = size;
+    rgn->io = io;
+    rgn->ino = ino;
+    rgn->off = off;
+    io->refcnt++; //the file has to stay open for as long as it's mapped
+    return 0;
+}
+
+
+// void memory_mmap_update (
+//      uint64_t ino, uint64_t pos, const void * buf, size_t len)
+// Keeps the mmap page cache in step with a write of /len/ bytes from /buf/ at
+// offset /pos/ of file /ino/. Cached pages nothing maps are dropped and read in
+// again on the next fault; pages that are still mapped get the new bytes copied
+// in, so the mappings see the write right away.
+//@param: uint64_t ino: file written to (its IOCTL_GETINO value)
+//@param: uint64_t pos: file offset the write started at
+//@param: const void* buf: the bytes written
+//@param: size_t len: number of bytes written
+void memory_mmap_update(uint64_t ino, uint64_t pos, const void * buf, size_t len) {
+    if (len == 0) {
+        return;
+    }
+
+    for (uint64_t pgoff = pos / PAGE_SIZE; pgoff <= (pos + len - 1) / PAGE_SIZE; pgoff++) {
+        struct mmap_page *mp = mmap_page_find(ino, pgoff);
+        if (mp == NULL) {
+            continue;
+        }
+        if (*page_refcnt_of(mp->page) == 0) {
+            mmap_page_drop(mp);
+            continue;
+        }
+
+        uint64_t start = (pos > pgoff * PAGE_SIZE) ? pos : pgoff * PAGE_SIZE; //overlap of the write with this page
+        uint64_t end = MIN(pos + len, (pgoff + 1) * PAGE_SIZE);
+        memcpy(mp->page + (start - pgoff * PAGE_SIZE), buf + (start - pos), end - start);
+    }
 }
 
 
 // Function: memory_space_clone
 // Description: Clones the memory space of the current process, creating a new memory space
-//              for the child process, including a deep copy of all user-space mappings.
+//              for the child process with its own page tables. User pages are not copied:
+//              parent and child share them read-only (copy-on-write), and a page is only
+//              copied when one of them stores to it (memory_handle_page_fault).
 // Parameters:
-//   - asid: Address Space Identifier (ASID) for the new memory space (typically 0).
+//   - asid: Address Space Identifier (ASID) for the new memory space (typically 0, which
+//           gets one from the ASID allocator).
 // Returns:
 //   - The new memory tag (SATP value) for the cloned memory space.
+//   - 0 if there aren't enough free mmap regions for the child's copies of the parent's
+//     file mappings (checked before anything is copied, so nothing needs undoing).
 //   - This function panics if memory allocation or copying fails.
 uintptr_t memory_space_clone(uint_fast16_t asid) {
     struct pte *parent_root = active_space_root(); // get parent pte root
@@ -718,6 +1157,19 @@ uintptr_t memory_space_clone(uint_fast16_t asid) {
         panic("Failed to retrieve parent process page table root");
     }
 
+    int rgn_needed = 0; // the child gets a copy of each of the parent's mmap regions
+    int rgn_free = 0;
+    for (int i = 0; i < MMAP_REGION_MAX; i++) {
+        if (mmap_regions[i].root == parent_root) {
+            rgn_needed++;
+        } else if (mmap_regions[i].root == NULL) {
+            rgn_free++;
+        }
+    }
+    if (rgn_needed > rgn_free) {
+        return 0;
+    }
+
     struct pte *child_root = (struct pte *)memory_alloc_page(); // allocate memory for the child root (Level 2 page table)
     if (!child_root) {
         panic("Failed to allocate memory for child root page table");
@@ -764,27 +1216,378 @@ uintptr_t memory_space_clone(uint_fast16_t asid) {
                     continue; // skip if pt0 values aren't valid
                 }
 
-                if (parent_pt0[vpn0].flags & PTE_U) {
-                    void *new_page = memory_alloc_page(); // allocate a new physical page for the child
-                    if (!new_page) {
-                        panic("Failed to allocate memory for user page");
+                if ((parent_pt0[vpn0].flags & PTE_U) && parent_pt0[vpn0].rsw == PTE_RSW_MMAP) {
+                    // Clean file pages are shared rather than copied
+                    mmap_page_ref(pagenum_to_pageptr(parent_pt0[vpn0].ppn));
+                    child_pt0[vpn0] = parent_pt0[vpn0];
+                } else if (parent_pt0[vpn0].flags & PTE_U) {
+                    void *page = pagenum_to_pageptr(parent_pt0[vpn0].ppn); // get the physical page pointer
+
+                    if (parent_pt0[vpn0].rsw == 0) {
+                        // First fork to share this page: the parent loses write access too
+                        // (the sfence_vma_space below drops its stale TLB entries)
+                        parent_pt0[vpn0].rsw = (parent_pt0[vpn0].flags & PTE_W) ? PTE_RSW_COW : PTE_RSW_SHARED;
+                        parent_pt0[vpn0].flags &= ~PTE_W;
+                        *page_refcnt_of(page) = 1;
                     }
+                    *page_refcnt_of(page) += 1;
 
-                    void *parent_page = pagenum_to_pageptr(parent_pt0[vpn0].ppn); // get the physical page pointer
-                    memcpy(new_page, parent_page, PAGE_SIZE); // copy the physical page
+                    // Map the same page in the child PT0
+                    child_pt0[vpn0] = parent_pt0[vpn0];
+                }
+            }
+        }
+    }
 
-                    // Map the new page in the child PT0
-                    child_pt0[vpn0] = leaf_pte(new_page, parent_pt0[vpn0].flags); // set the new child pt0's flags as the leaf pte
-                } 
+    // the child maps the same files at the same places
+    for (int i = 0; i < MMAP_REGION_MAX; i++) {
+        if (mmap_regions[i].root != parent_root)
+            continue;
+        for (int j = 0; j < MMAP_REGION_MAX; j++) {
+            if (mmap_regions[j].root == NULL) {
+                mmap_regions[j] = mmap_regions[i];
+                mmap_regions[j].root = child_root;
+                mmap_regions[j].io->refcnt++;
+                break;
             }
         }
     }
 
     // construct SATP tag for the child process
+    if (asid == 0) {
+        asid = asid_alloc(child_root);
+    }
     uintptr_t new_mtag = ((uintptr_t)RISCV_SATP_MODE_Sv39 << RISCV_SATP_MODE_shift) |
                          ((uintptr_t)asid << RISCV_SATP_ASID_shift) |
                          pageptr_to_pagenum(child_root); 
 
-    sfence_vma(); // tlb flush
+    sfence_vma_space(); // tlb flush, the parent's shared pages are read-only now
     return new_mtag;
 }
+
+
+// mmap_find: finds the mmap region of a memory space that contains vma
+//@param: const struct pte* root: root page table of the memory space
+//@param: uintptr_t vma: virtual address to look up
+//@return: the region, or NULL if vma isn't part of a mapped file
+static struct mmap_region * mmap_find(const struct pte * root, uintptr_t vma) {
+    for (int i = 0; i < MMAP_REGION_MAX; i++) {
+        struct mmap_region *rgn = &mmap_regions[i];
+        if (rgn->root == root && vma >= rgn->start && vma - rgn->start < rgn->size) {
+            return rgn;
+        }
+    }
+    return NULL;
+}
+
+// mmap_page_get: returns the physical page holding page /pgoff/ of a region's
+// file with a reference taken on it. If it isn't in the mmap page cache, it is
+// read in from the file and cached.
+//@param: const struct mmap_region* rgn: region being faulted on
+//@param: uint64_t pgoff: page index within the file
+//@return: the page, or NULL if the file couldn't be read
+static void * mmap_page_get(const struct mmap_region * rgn, uint64_t pgoff) {
+    struct mmap_page *mp;
+    void *page;
+    long cnt;
+
+    mp = mmap_page_find(rgn->ino, pgoff);
+    if (mp == NULL) {
+        page = memory_alloc_page();
+        cnt = ioreadat(rgn->io, pgoff * PAGE_SIZE, page, PAGE_SIZE);
+        if (cnt < 0) {
+            memory_free_page(page);
+            return NULL;
+        }
+        memset(page + cnt, 0, PAGE_SIZE - cnt); //past the end of the file reads as zeroes
+
+        //the read may have slept, so someone else may have brought the same page in meanwhile
+        mp = mmap_page_find(rgn->ino, pgoff);
+        if (mp != NULL) {
+            memory_free_page(page);
+        } else {
+            mp = slab_alloc(&mmap_page_cache);
+            mp->page = page;
+            mp->ino = rgn->ino;
+            mp->pgoff = pgoff;
+            mp->hnext = mmap_hash[mmap_hash_of(rgn->ino, pgoff)];
+            mmap_hash[mmap_hash_of(rgn->ino, pgoff)] = mp;
+            mmap_lru_append(mp);
+        }
+    }
+
+    if (mmap_lru_tail != mp) { //most recently used now
+        mmap_lru_remove(mp);
+        mmap_lru_append(mp);
+    }
+    *page_refcnt_of(mp->page) += 1;
+    return mp->page;
+}
+
+// mmap_page_ref: takes another reference on a page from the mmap page cache
+//@param: const void* page: physical page mapped with PTE_RSW_MMAP
+static void mmap_page_ref(const void * page) {
+    *page_refcnt_of(page) += 1;
+}
+
+// mmap_page_put: drops a reference on a page from the mmap page cache. The page
+// stays cached once nothing maps it anymore; mmap_evict frees it if the memory
+// is needed.
+//@param: const void* page: physical page mapped with PTE_RSW_MMAP
+static void mmap_page_put(const void * page) {
+    uint16_t *refcnt = page_refcnt_of(page);
+
+    if (*refcnt == 0) {
+        panic("mmap page without references");
+    }
+    *refcnt -= 1;
+}
+
+// mmap_hash_of: returns the hash bucket of a file page in the mmap page cache
+//@param: uint64_t ino: file the page comes from
+//@param: uint64_t pgoff: page index within the file
+static inline size_t mmap_hash_of(uint64_t ino, uint64_t pgoff) {
+    return (ino * 31 + pgoff) % MMAP_HASH_SIZE;
+}
+
+// mmap_page_find: looks a file page up in the mmap page cache
+//@param: uint64_t ino: file the page comes from
+//@param: uint64_t pgoff: page index within the file
+//@return: the cache entry, NULL if the page isn't cached
+static struct mmap_page * mmap_page_find(uint64_t ino, uint64_t pgoff) {
+    struct mmap_page *mp;
+
+    for (mp = mmap_hash[mmap_hash_of(ino, pgoff)]; mp != NULL; mp = mp->hnext) {
+        if (mp->ino == ino && mp->pgoff == pgoff) {
+            return mp;
+        }
+    }
+    return NULL;
+}
+
+// mmap_lru_append: puts a cache entry at the most recently used end of the LRU list
+//@param: struct mmap_page* mp: entry, not on the list
+static void mmap_lru_append(struct mmap_page * mp) {
+    mp->lru_next = NULL;
+    mp->lru_prev = mmap_lru_tail;
+    if (mmap_lru_tail != NULL) {
+        mmap_lru_tail->lru_next = mp;
+    } else {
+        mmap_lru_head = mp;
+    }
+    mmap_lru_tail = mp;
+}
+
+// mmap_lru_remove: takes a cache entry off the LRU list
+//@param: struct mmap_page* mp: entry on the list
+static void mmap_lru_remove(struct mmap_page * mp) {
+    if (mp->lru_prev != NULL) {
+        mp->lru_prev->lru_next = mp->lru_next;
+    } else {
+        mmap_lru_head = mp->lru_next;
+    }
+    if (mp->lru_next != NULL) {
+        mp->lru_next->lru_prev = mp->lru_prev;
+    } else {
+        mmap_lru_tail = mp->lru_prev;
+    }
+}
+
+// mmap_evict: frees the least recently faulted on page of the mmap page cache
+// that nothing maps anymore. Cached pages are clean, so nothing is written back.
+//@return: 1 if a page was freed, 0 if every cached page is still mapped
+static int mmap_evict(void) {
+    struct mmap_page *mp;
+
+    for (mp = mmap_lru_head; mp != NULL; mp = mp->lru_next) {
+        if (*page_refcnt_of(mp->page) == 0) {
+            break;
+        }
+    }
+    if (mp == NULL) {
+        return 0;
+    }
+
+    mmap_page_drop(mp);
+    return 1;
+}
+
+// mmap_page_drop: takes a page nothing maps out of the mmap page cache and frees it
+//@param: struct mmap_page* mp: cache entry of the page
+static void mmap_page_drop(struct mmap_page * mp) {
+    struct mmap_page **link = &mmap_hash[mmap_hash_of(mp->ino, mp->pgoff)];
+
+    while (*link != mp) {
+        link = &(*link)->hnext;
+    }
+    *link = mp->hnext;
+    mmap_lru_remove(mp);
+    memory_free_page(mp->page);
+    slab_free(&mmap_page_cache, mp);
+}
+
+// mmap_release_space: forgets every mmap region of a memory space and closes
+// the files they were holding open
+//@param: const struct pte* root: root page table of the memory space
+static void mmap_release_space(const struct pte * root) {
+    for (int i = 0; i < MMAP_REGION_MAX; i++) {
+        if (mmap_regions[i].root == root) {
+            mmap_regions[i].root = NULL;
+            ioclose(mmap_regions[i].io);
+        }
+    }
+}
+
+// page_index: returns the number of a physical page of RAM, counting from RAM_START
+//@param: const void* pp: the (direct-mapped) physical page
+static inline size_t page_index(const void * pp) {
+    return ((uintptr_t)pp - RAM_START_PMA) / PAGE_SIZE;
+}
+
+// free_area_push: puts a free block on the free list of its order
+//@param: union linked_page* blk: first page of the block
+//@param: unsigned int order: order of the block
+static void free_area_push(union linked_page * blk, unsigned int order) {
+    blk->prev = NULL;
+    blk->next = free_area[order];
+    if (blk->next != NULL) {
+        blk->next->prev = blk;
+    }
+    free_area[order] = blk;
+    free_cnt[order]++;
+    free_order[page_index(blk)] = order + 1;
+}
+
+// free_area_remove: takes a free block off the free list of its order
+//@param: union linked_page* blk: first page of the block
+//@param: unsigned int order: order of the block
+static void free_area_remove(union linked_page * blk, unsigned int order) {
+    if (blk->prev != NULL) {
+        blk->prev->next = blk->next;
+    } else {
+        free_area[order] = blk->next;
+    }
+    if (blk->next != NULL) {
+        blk->next->prev = blk->prev;
+    }
+    free_cnt[order]--;
+    free_order[page_index(blk)] = 0;
+}
+
+// pool_carve: takes a block of 2^order pages from the pool of pages that were
+// never handed out. The block has to be aligned to its size, so the pages
+// skipped to get there are freed onto the free lists instead.
+//@param: unsigned int order: order of the block
+//@return: the first page of the block, NULL if the pool doesn't have one
+static void * pool_carve(unsigned int order) {
+    const size_t blksz = PAGE_SIZE << order;
+    void *blk = round_up_ptr(pool_next, blksz);
+
+    if (blk > (void*)RAM_END || (void*)RAM_END - blk < blksz) {
+        return NULL;
+    }
+
+    while (pool_next < blk) { //skipped pages, in the largest aligned pieces they form
+        unsigned int k = 0;
+        while (k + 1 < order && page_index(pool_next) % (2UL << k) == 0 &&
+            pool_next + (PAGE_SIZE << (k + 1)) <= blk)
+        {
+            k++;
+        }
+        void *piece = pool_next;
+        pool_next += PAGE_SIZE << k;
+        memory_free_pages(piece, k);
+    }
+
+    pool_next = blk + blksz;
+    return blk;
+}
+
+// page_refcnt_of: returns the reference count of a physical page of RAM
+//@param: const void* pp: the (direct-mapped) physical page
+static inline uint16_t * page_refcnt_of(const void * pp) {
+    return &page_refcnt[page_index(pp)];
+}
+
+// cow_page_break: gives the active memory space its own writable copy of a
+// copy-on-write page after a store to it. If no other space shares the page
+// anymore, it is just made writable again instead of copied.
+//@param: struct pte* pte: leaf PTE mapping the page with PTE_RSW_COW
+static void cow_page_break(struct pte * pte) {
+    void *page = pagenum_to_pageptr(pte->ppn);
+    uint16_t *refcnt = page_refcnt_of(page);
+
+    if (*refcnt > 1) {
+        void *copy = memory_alloc_page();
+        memcpy(copy, page, PAGE_SIZE);
+        *refcnt -= 1; //the others keep sharing the original
+        pte->ppn = pageptr_to_pagenum(copy);
+    } else {
+        *refcnt = 0; //ours alone now
+    }
+
+    pte->rsw = 0;
+    pte->flags |= PTE_W | PTE_A | PTE_D;
+}
+
+// cow_page_put: drops a reference on a page mapped with PTE_RSW_COW or
+// PTE_RSW_SHARED and frees the page once nothing maps it anymore
+//@param: void* pp: the physical page
+static void cow_page_put(void * pp) {
+    uint16_t *refcnt = page_refcnt_of(pp);
+
+    if (*refcnt == 0) {
+        panic("cow page without references");
+    }
+    if (--*refcnt == 0) {
+        memory_free_page(pp);
+    }
+}
+
+// asid_alloc: hands out an ASID for a memory space. When the current generation
+// has none left, a new one starts: every ASID is taken back (except the active
+// space's, which keeps running with it) and the whole TLB is flushed, so the
+// ASIDs handed out again carry no stale entries.
+//@param: const struct pte* root: root page table of the memory space
+//@return: the ASID, 0 if the hart has none
+static uint_fast16_t asid_alloc(const struct pte * root) {
+    if (asid_max == 0) {
+        return 0;
+    }
+
+    while (asid_next <= asid_max && asid_root[asid_next] != NULL) {
+        asid_next++;
+    }
+
+    if (asid_next > asid_max) { //rollover
+        const uintptr_t active = active_space_mtag();
+        memset(asid_root, 0, sizeof(asid_root));
+        if (active != main_mtag) {
+            asid_root[mtag_to_asid(active)] = mtag_to_root(active);
+        }
+        sfence_vma();
+        asid_next = 1;
+        while (asid_root[asid_next] != NULL) {
+            asid_next++;
+        }
+    }
+
+    asid_root[asid_next] = root;
+    return asid_next++;
+}
+
+// asid_release: takes back the ASID of a memory space that is going away, along
+// with whatever TLB entries it still has
+//@param: uintptr_t mtag: tag of the memory space (not the active one)
+static void asid_release(uintptr_t mtag) {
+    const uintptr_t asid = mtag_to_asid(mtag);
+
+    if (asid_max == 0) {
+        sfence_vma(); //no ASIDs, nothing finer to flush by
+        return;
+    }
+    asm inline ("sfence.vma zero, %0" :: "r"(asid) : "memory");
+    if (asid_root[asid] == mtag_to_root(mtag)) {
+        asid_root[asid] = NULL; //not reused before the next generation anyway
+    }
+}
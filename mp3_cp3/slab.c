@@ -0,0 +1,104 @@
+// slab.c - Object caches for fixed-size kernel objects
+//
+// Objects are laid out back to back in a slab, each rounded up to a multiple of
+// a pointer so the free list link in the first word is aligned. A slab is the
+// smallest block of 2^order pages that holds at least one object. Caches are
+// only used by threads, but a thread can be preempted in the middle of a free
+// list update, so the list is only touched with interrupts disabled.
+
+#include "slab.h"
+#include "memory.h"
+#include "intr.h"
+#include "halt.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// INTERNAL MACRO DEFINITIONS
+//
+
+// Size a slab takes per object of /sz/ bytes: room for at least the free list
+// link, rounded up to pointer alignment
+
+#define SLAB_OBJSZ(sz) \
+    (((sz) < sizeof(void *) ? sizeof(void *) : (sz) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+extern void * memory_alloc_pages(unsigned int order); // memory.c
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void slab_grow(struct slab_cache * sc);
+
+// EXPORTED FUNCTION DEFINITIONS
+//
+
+void slab_cache_init (
+    struct slab_cache * sc, const char * name, size_t objsz, void (*ctor)(void * obj))
+{
+    *sc = (struct slab_cache)SLAB_CACHE_INITIALIZER(name, objsz, ctor);
+}
+
+void * slab_alloc(struct slab_cache * sc) {
+    void * obj;
+    int s;
+
+    s = intr_disable();
+    if (sc->freelist == NULL)
+        slab_grow(sc);
+    obj = sc->freelist;
+    sc->freelist = *(void **)obj;
+    sc->stats.inuse += 1;
+    sc->stats.allocs += 1;
+    intr_restore(s);
+
+    if (sc->ctor != NULL)
+        sc->ctor(obj);
+    return obj;
+}
+
+void slab_free(struct slab_cache * sc, void * obj) {
+    int s;
+
+    assert (obj != NULL && sc->stats.inuse != 0);
+
+    s = intr_disable();
+    *(void **)obj = sc->freelist;
+    sc->freelist = obj;
+    sc->stats.inuse -= 1;
+    intr_restore(s);
+}
+
+// INTERNAL FUNCTION DEFINITIONS
+//
+
+// Takes a new slab from the page allocator and puts all of its objects on the
+// cache's free list. Interrupts are disabled.
+
+static void slab_grow(struct slab_cache * sc) {
+    const size_t objsz = SLAB_OBJSZ(sc->objsz);
+    size_t slabsz;
+    char * slab;
+    size_t cnt;
+
+    while ((PAGE_SIZE << sc->order) < objsz)
+        sc->order += 1; // only objects bigger than a page need more than one
+
+    slabsz = PAGE_SIZE << sc->order;
+    slab = memory_alloc_pages(sc->order);
+    cnt = slabsz / objsz;
+
+    // Push them from the end so the list hands them out in address order
+
+    for (size_t i = cnt; i > 0; i--) {
+        void ** const obj = (void **)(slab + (i - 1) * objsz);
+        *obj = sc->freelist;
+        sc->freelist = obj;
+    }
+
+    sc->stats.slabs += 1;
+    sc->stats.objs += cnt;
+}
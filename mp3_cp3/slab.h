@@ -0,0 +1,58 @@
+// slab.h - Object caches for fixed-size kernel objects
+//
+// A slab cache hands out objects of one size (e.g. struct thread) from whole
+// pages it gets from the page allocator, so objects that come and go often
+// don't fragment the small kernel heap. Free objects are kept on a list
+// threaded through the objects themselves, which makes slab_alloc and
+// slab_free constant time; a cache only goes to the page allocator when that
+// list is empty, and then carves up a whole slab at once. Slabs are never given
+// back to the page allocator.
+
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// EXPORTED TYPE DEFINITIONS
+//
+
+struct slab_stats {
+    unsigned long slabs; // slabs taken from the page allocator
+    unsigned long objs; // objects carved out of them
+    unsigned long inuse; // objects handed out and not freed yet
+    unsigned long allocs; // slab_alloc calls since the cache was set up
+};
+
+struct slab_cache {
+    const char * name;
+    size_t objsz; // object size, as given
+    void (*ctor)(void * obj); // run on every object slab_alloc hands out, or NULL
+    unsigned int order; // a slab is 2^order pages, 0 until the first slab is made
+    void * freelist; // free objects, each holding a pointer to the next one
+    struct slab_stats stats;
+};
+
+// A cache can be set up statically with SLAB_CACHE_INITIALIZER, or at run time
+// with slab_cache_init; either way no memory is taken until the first
+// slab_alloc.
+
+#define SLAB_CACHE_INITIALIZER(nm, sz, ct) \
+    { .name = (nm), .objsz = (sz), .ctor = (ct) }
+
+// EXPORTED FUNCTION DECLARATIONS
+//
+
+extern void slab_cache_init (
+    struct slab_cache * sc, const char * name, size_t objsz, void (*ctor)(void * obj));
+
+// Returns an object from the cache, after running the cache's constructor on
+// it. Does not fail; panics if the page allocator is out of pages.
+
+extern void * slab_alloc(struct slab_cache * sc);
+
+// Gives an object back to the cache it came from.
+
+extern void slab_free(struct slab_cache * sc, void * obj);
+
+#endif // _SLAB_H_
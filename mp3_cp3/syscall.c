@@ -9,9 +9,46 @@
 #include "error.h"
 #include "timer.h"
 #include "heap.h"
+#include "string.h"
+#include "ioext.h"
+#include "slab.h"
+#include "bcache.h"
 
 #define MAIN_TID 0
 
+// Syscall numbers added on top of scnum.h. Kept well clear of the existing ones.
+#ifndef SYSCALL_PREAD
+#define SYSCALL_PREAD   32
+#endif
+#ifndef SYSCALL_PWRITE
+#define SYSCALL_PWRITE  33
+#endif
+#ifndef SYSCALL_MMAP
+#define SYSCALL_MMAP    34
+#endif
+#ifndef SYSCALL_FSYNC
+#define SYSCALL_FSYNC   35
+#endif
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+extern int memory_mmap(uintptr_t vma, size_t size, struct io_intf *io, uint64_t off); // memory.c
+extern int memory_prepare_user_write(void *buf, size_t len); // memory.c
+
+// INTERNAL FUNCTION DECLARATIONS
+//
+
+static void process_ctor(void *obj);
+static size_t ioctl_out_size(int cmd);
+
+// INTERNAL GLOBAL VARIABLES
+//
+
+// Forked processes come from here, zeroed by process_ctor
+static struct slab_cache process_cache =
+    SLAB_CACHE_INITIALIZER("process", sizeof(struct process), process_ctor);
+
 
 // Description: Prints a message to the console.
 // Parameters:
@@ -155,6 +192,10 @@ static long sysread(int fd, void *buf, size_t bufsz) {
     // if(memory_validate_vptr_len(buf, bufsz, PTE_W | PTE_U) != 0) {
     //     return -1; // Invalid user buffer
     // }
+
+    if(memory_prepare_user_write(buf, bufsz) != 0) { // copy-on-write pages get copied before the kernel stores to them
+        return -1;
+    }
     
     if(ioread_full(proc->iotab[fd], buf, bufsz) != bufsz) { // try to read from whatever io device or file
         return -1;
@@ -191,6 +232,93 @@ static long syswrite(int fd, const void *buf, size_t len) {
     return len; // return the bytes written
 }
 
+// Function: syspread
+// Description: Reads data at a given offset of an opened file descriptor without moving its position.
+// Parameters:
+//   - fd: File descriptor index to read from.
+//   - buf: Pointer to the buffer where data will be stored.
+//   - bufsz: Size of the buffer.
+//   - pos: Offset to start reading at.
+// Returns:
+//   - Number of bytes read on success (less than bufsz at the end of the file).
+//   - -1 on failure.
+static long syspread(int fd, void *buf, size_t bufsz, uint64_t pos) {
+    struct process *proc = current_process(); // get current process
+    if(fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL) { // boundary checks
+        return -1;
+    }
+
+    if(memory_prepare_user_write(buf, bufsz) != 0) { // copy-on-write pages get copied before the kernel stores to them
+        return -1;
+    }
+
+    long ret = ioreadat(proc->iotab[fd], pos, buf, bufsz); // positional read, falls back to seek + read
+    return (ret < 0) ? -1 : ret;
+}
+
+// Function: syspwrite
+// Description: Writes data at a given offset of an opened file descriptor without moving its position.
+// Parameters:
+//   - fd: File descriptor index to write to.
+//   - buf: Pointer to the buffer containing the data to write.
+//   - len: Length of the data to write.
+//   - pos: Offset to start writing at.
+// Returns:
+//   - Number of bytes written on success.
+//   - -1 on failure.
+static long syspwrite(int fd, const void *buf, size_t len, uint64_t pos) {
+    struct process *proc = current_process(); // get current process
+    if(fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL) { // boundary checks
+        return -1;
+    }
+
+    long ret = iowriteat(proc->iotab[fd], pos, buf, len); // positional write, falls back to seek + write
+    return (ret < 0) ? -1 : ret;
+}
+
+// Function: sysmmap
+// Description: Maps part of an opened file read-only into the current process at a fixed address.
+//              Pages are read from the file on first access and shared with other processes mapping the same file.
+// Parameters:
+//   - fd: File descriptor index of the file to map.
+//   - vma: Page-aligned user address to map the file at.
+//   - len: Number of bytes to map.
+//   - off: Page-aligned offset in the file to start the mapping at.
+// Returns:
+//   - vma on success.
+//   - -1 on failure.
+static long sysmmap(int fd, uintptr_t vma, size_t len, uint64_t off) {
+    struct process *proc = current_process(); // get current process
+    if(fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL) { // boundary checks
+        return -1;
+    }
+
+    if(memory_mmap(vma, len, proc->iotab[fd], off) != 0) { // only kfs files can be mapped
+        return -1;
+    }
+    return vma;
+}
+
+// Function: sysfsync
+// Description: Makes sure everything written to a file descriptor has reached the device.
+// Parameters:
+//   - fd: File descriptor index to sync.
+// Returns:
+//   - 0 on success (including devices that don't buffer writes).
+//   - -1 on failure.
+static int sysfsync(int fd) {
+    struct process *proc = current_process(); // get current process
+    if(fd < 0 || fd >= PROCESS_IOMAX || proc->iotab[fd] == NULL) { // boundary checks
+        return -1;
+    }
+
+    int ret = ioctl(proc->iotab[fd], IOCTL_FLUSH, NULL); // write back whatever is cached
+    if(ret != 0 && ret != -ENOTSUP) { // nothing to flush is fine
+        return -1;
+    }
+    return 0;
+}
+
 // Function: sysioctl
 // Description: Performs an ioctl operation on a file descriptor.
 // Parameters:
@@ -209,6 +337,16 @@ static int sysioctl(int fd, int cmd, void *arg) {
         return -1;
     }
 
+    if(arg != NULL && memory_prepare_user_write(arg, ioctl_out_size(cmd)) != 0) { // results get stored through arg
+        return -1;
+    }
+    if(cmd == IOCTL_READAT) { // and a positional read into the buffer it points to
+        struct io_posrw *rw = arg;
+        if(memory_prepare_user_write(rw->buf, rw->len) != 0) {
+            return -1;
+        }
+    }
+
     if(ioctl(proc->iotab[fd], cmd, arg) != 0) { // ioctl functions liek get pos, set pos, etc
         return -1;
     }
@@ -236,6 +374,39 @@ static int sysexec(int fd) {
     return 0; 
 }
 
+// Description: Size of what an ioctl command stores through its arg, so the kernel's stores to
+//              user memory don't hit copy-on-write pages (memory_prepare_user_write).
+// Parameters:
+//   - cmd: Ioctl command.
+// Returns:
+//   - Number of bytes written at arg, 0 if the command only reads it.
+static size_t ioctl_out_size(int cmd) {
+    switch(cmd) {
+    case IOCTL_GETLEN:
+    case IOCTL_GETPOS:
+    case IOCTL_GETBLKSZ:
+    case IOCTL_GETINO:
+        return sizeof(uint64_t);
+    case IOCTL_GETCACHESTATS:
+        return sizeof(struct bcache_stats);
+    case IOCTL_GETSCHEDSTATS:
+        return sizeof(struct io_schedstats);
+    case IOCTL_GETLATSTATS:
+        return sizeof(struct io_latstats);
+    case IOCTL_GETSTATS:
+        return sizeof(struct io_blkstats);
+    default:
+        return 0;
+    }
+}
+
+// Description: Constructor for process_cache, so every forked process starts out zeroed.
+// Parameters:
+//   - obj: The struct process handed out by slab_alloc.
+static void process_ctor(void *obj) {
+    memset(obj, 0, sizeof(struct process));
+}
+
 // Function: sysfork
 // Description: The fork system call duplicates the currently running process and creates a child process which starts at the
 // same point in the original or parent process. fork returns the pid of the child process to the parent process.
@@ -245,12 +416,7 @@ static int sysexec(int fd) {
 static int sysfork(const struct trap_frame *tfr) {
     struct process *parent_proc = current_process();
     //kprintf("PARENT MTAG: %p \n", parent_proc->mtag);
-    struct process *child_proc = (struct process *)kmalloc(sizeof(struct process)); // malloc child process
-
-    if (child_proc == NULL) {
-        return -1; 
-    }
-    memset(child_proc, 0, sizeof(struct process)); // set to zero (not necessary but safe)
+    struct process *child_proc = slab_alloc(&process_cache); // allocate child process, already zeroed
 
     // Copy process state from parent to child
     //memcpy(child_proc, parent_proc, sizeof(struct process));
@@ -275,7 +441,20 @@ static int sysfork(const struct trap_frame *tfr) {
     }
 
     // Fork a new thread for the child process
-    return thread_fork_to_user(child_proc, tfr); 
+    int child_tid = thread_fork_to_user(child_proc, tfr);
+    if (child_tid < 0) { // memory space couldn't be cloned, undo the above
+        for (int i = 0; i < PROCESS_IOMAX; i++) {
+            if (child_proc->iotab[i] != NULL) {
+                child_proc->iotab[i]->refcnt--; // the parent still holds it
+            }
+        }
+        if (proctab[child_proc->id] == child_proc) {
+            proctab[child_proc->id] = NULL;
+        }
+        slab_free(&process_cache, child_proc);
+        return -1;
+    }
+    return child_tid;
 }
 
 
@@ -336,6 +515,18 @@ extern void syscall_handler(struct trap_frame *tfr) {
         case SYSCALL_WRITE:
             ret = syswrite(tfr->x[TFR_A0], (const void *)tfr->x[TFR_A1], tfr->x[TFR_A2]);
             break;
+        case SYSCALL_PREAD:
+            ret = syspread(tfr->x[TFR_A0], (void *)tfr->x[TFR_A1], tfr->x[TFR_A2], tfr->x[TFR_A3]);
+            break;
+        case SYSCALL_PWRITE:
+            ret = syspwrite(tfr->x[TFR_A0], (const void *)tfr->x[TFR_A1], tfr->x[TFR_A2], tfr->x[TFR_A3]);
+            break;
+        case SYSCALL_MMAP:
+            ret = sysmmap(tfr->x[TFR_A0], tfr->x[TFR_A1], tfr->x[TFR_A2], tfr->x[TFR_A3]);
+            break;
+        case SYSCALL_FSYNC:
+            ret = sysfsync(tfr->x[TFR_A0]);
+            break;
         case SYSCALL_IOCTL:
             ret = sysioctl(tfr->x[TFR_A0], tfr->x[TFR_A1], (void *)tfr->x[TFR_A2]);
             break;
@@ -14,6 +14,7 @@
 #include "intr.h"
 #include "process.h"
 #include "memory.h"
+#include "slab.h"
 
 // COMPILE-TIME PARAMETERS
 //
@@ -90,6 +91,11 @@ static struct thread * thrtab[NTHR] = {
 
 static struct thread_list ready_list;
 
+// struct threads other than the main and idle threads come from here
+
+static struct slab_cache thread_cache =
+    SLAB_CACHE_INITIALIZER("thread", sizeof(struct thread), NULL);
+
 // INTERNAL MACRO DEFINITIONS
 // 
 
@@ -175,6 +181,8 @@ extern void __attribute__ ((noreturn)) _thread_finish_jump (
 extern void _thread_finish_fork (
     struct thread * child, const struct trap_frame * parent_tfr, ...);
 
+extern uintptr_t memory_space_activate(uintptr_t * mtagp); // memory.c
+
 
 // EXPORTED FUNCTION DEFINITIONS
 //
@@ -213,7 +221,7 @@ int thread_spawn(const char * name, void (*start)(void *), void * arg) {
     
     // Allocate a struct thread and a stack
 
-    child = kmalloc(sizeof(struct thread));
+    child = slab_alloc(&thread_cache);
 
     stack_page = memory_alloc_page();
     stack_anchor = stack_page + PAGE_SIZE;
@@ -269,14 +277,11 @@ int thread_create(const char *name, struct process *child_proc) {
     }
 
     // Allocate a struct thread and a stack
-    child = kmalloc(sizeof(struct thread)); // malloc for child thread
-    if (!child) {
-        panic("Failed to allocate child thread structure");
-    }
+    child = slab_alloc(&thread_cache); // allocate child thread
 
     stack_page = memory_alloc_page(); // malloc stack page
     if (!stack_page) {
-        kfree(child);
+        slab_free(&thread_cache, child);
         panic("Failed to allocate kernel stack");
     }
 
@@ -326,8 +331,16 @@ void thread_jump_to_user(uintptr_t usp, uintptr_t upc) {
 //   - parent_tfr: Pointer to the trap frame of the parent thread, used to initialize the child thread's state.
 // Returns:
 //   - The thread ID (tid) of the child thread on success.
-//   - This function panics if the thread creation or memory space cloning fails.
+//   - -1 if the memory space can't be cloned (nothing has been created then).
+//   - This function panics if the thread creation fails.
 int thread_fork_to_user(struct process *child_proc, const struct trap_frame *parent_tfr) {
+    // Clone the memory space first, it's the part that can fail
+    uintptr_t new_mtag = memory_space_clone(0);  // clone parent process memory space, asid 0 gets it a fresh one
+    if (new_mtag == 0) {
+        return -1;
+    }
+    child_proc->mtag = new_mtag;
+
     // Create the child thread
     int child_tid = thread_create("child", child_proc); // create the child thread
     if (child_tid < 0) {
@@ -347,9 +360,6 @@ int thread_fork_to_user(struct process *child_proc, const struct trap_frame *par
     // kprintf("Child trap frame sp: %p\n", child_tfr->x[TFR_SP]);
     // kprintf("Parent trap frame sepc: %p, sstatus: %p\n", parent_tfr->sepc, parent_tfr->sstatus);
     // kprintf("Parent trap frame sp: %p\n", parent_tfr->x[TFR_SP]);
-   
-    uintptr_t new_mtag = memory_space_clone(0);  // clone parent process memory space with asid 0
-    child_proc->mtag = new_mtag;
 
     // Suspend parent thread and add it to the ready list
     int s = intr_disable();
@@ -578,7 +588,7 @@ void recycle_thread(int tid) {
     }
 
     thrtab[tid] = NULL;
-    kfree(thr);
+    slab_free(&thread_cache, thr);
 }
 
 void suspend_self(void) {
@@ -615,7 +625,7 @@ void suspend_self(void) {
     intr_enable();
 
     if (next_thread->proc != NULL)
-        memory_space_switch(next_thread->proc->mtag);
+        memory_space_activate(&next_thread->proc->mtag); // no TLB flush, the space has its own ASID
 
     trace("Thread <%s> calling _thread_swtch(<%s>)",
         CURTHR->name, next_thread->name);
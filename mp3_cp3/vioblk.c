@@ -11,6 +11,9 @@
 #include "string.h"
 #include "thread.h"
 #include "lock.h"
+#include "ioext.h"
+#include "memory.h"
+#include "timer.h"
 
 
 //           COMPILE-TIME PARAMETERS
@@ -18,8 +21,65 @@
 
 #define VIOBLK_IRQ_PRIO 1
 
-// Assumption: The system will crash on errors. Locks are not explicitly released in error paths.
-static struct lock vio_lock;
+//           Number of request slots, i.e. how many requests can be in flight at once. Power
+//           of two; cut down at attach time if the device's queue is smaller.
+
+#ifndef VIOBLK_QLEN
+#define VIOBLK_QLEN 16
+#endif
+
+//           Most data descriptors one request can have. Bigger transfers are split into
+//           several requests; the device's own VIRTIO_BLK_F_SEG_MAX can lower it further.
+
+#ifndef VIOBLK_MAXSEG
+#define VIOBLK_MAXSEG 16
+#endif
+
+//           Number of sectors kept resident in the sector cache (see vioblk_scache_get).
+
+#ifndef VIOBLK_SCACHE
+#define VIOBLK_SCACHE 4
+#endif
+
+//           Most requests handed to the device at once. Requests beyond that wait in the
+//           scheduler, where they can be merged and reordered (see vioblk_sched_add).
+
+#ifndef VIOBLK_DEPTH
+#define VIOBLK_DEPTH 4
+#endif
+
+//           Scheduler policy at attach time (IO_SCHED_ in ioext.h), and how long the
+//           elevator lets the oldest queued request wait before it goes out of order.
+
+#ifndef VIOBLK_SCHED
+#define VIOBLK_SCHED IO_SCHED_ELEVATOR
+#endif
+
+#ifndef VIOBLK_DEADLINE_MS
+#define VIOBLK_DEADLINE_MS 50
+#endif
+
+//           How long a submitting thread busy-polls the used ring for its completion before
+//           going to sleep on the interrupt, in microseconds; 0 never polls. Can be changed
+//           with IOCTL_SETPOLL.
+
+#ifndef VIOBLK_POLL_US
+#define VIOBLK_POLL_US 0
+#endif
+
+//           Buckets in the per-request latency histograms: bucket b counts requests that took
+//           [2^b, 2^(b+1)) timer ticks.
+
+#define VIOBLK_LATBUCKETS IO_LAT_NBUCKETS
+
+//           Most virtqueues used when the device offers several (VIRTIO_BLK_F_MQ).
+
+#ifndef VIOBLK_MAXQ
+#define VIOBLK_MAXQ 4
+#endif
+
+//           Define VIOBLK_RING_PACKED to drive the device through packed virtqueues
+//           (VIRTIO_F_RING_PACKED) instead of split ones; the device then has to offer them.
 
 //           INTERNAL CONSTANT DEFINITIONS
 //          
@@ -38,6 +98,52 @@ static struct lock vio_lock;
 #define VIRTIO_BLK_F_DISCARD        13
 #define VIRTIO_BLK_F_WRITE_ZEROES   14
 
+//           Generic ring feature and ring flags used for interrupt and notification
+//           suppression, in case virtio.h leaves them out
+
+#ifndef VIRTIO_F_EVENT_IDX
+#define VIRTIO_F_EVENT_IDX          29
+#endif
+
+#ifndef VIRTQ_AVAIL_F_NO_INTERRUPT
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#endif
+
+#ifndef VIRTQ_USED_F_NO_NOTIFY
+#define VIRTQ_USED_F_NO_NOTIFY      1
+#endif
+
+//           Same for packed virtqueues: the feature, the descriptor flags the driver and
+//           the device flip to hand an entry back and forth, and the event suppression flags
+
+#ifndef VIRTIO_F_RING_PACKED
+#define VIRTIO_F_RING_PACKED        34
+#endif
+
+#ifndef VIRTQ_DESC_F_AVAIL
+#define VIRTQ_DESC_F_AVAIL          (1 << 7)
+#endif
+
+#ifndef VIRTQ_DESC_F_USED
+#define VIRTQ_DESC_F_USED           (1 << 15)
+#endif
+
+#ifndef VIRTQ_RING_EVENT_ENABLE
+#define VIRTQ_RING_EVENT_ENABLE     0
+#define VIRTQ_RING_EVENT_DISABLE    1
+#define VIRTQ_RING_EVENT_DESC       2
+#endif
+
+//           Byte offsets of fields in the device configuration space
+
+#define VIRTIO_BLK_CFG_SIZE_MAX     8
+#define VIRTIO_BLK_CFG_SEG_MAX      12
+#define VIRTIO_BLK_CFG_NUM_QUEUES   34
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS      36
+#define VIRTIO_BLK_CFG_MAX_DISCARD_SEG          40
+#define VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SECTORS 48
+#define VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SEG     52
+
 //           INTERNAL TYPE DEFINITIONS
 //          
 
@@ -56,6 +162,34 @@ struct vioblk_request_header {
 
 #define VIRTIO_BLK_T_IN             0
 #define VIRTIO_BLK_T_OUT            1
+#define VIRTIO_BLK_T_FLUSH          4
+#define VIRTIO_BLK_T_DISCARD        11
+#define VIRTIO_BLK_T_WRITE_ZEROES   13
+
+//           The data of a VIRTIO_BLK_T_DISCARD or VIRTIO_BLK_T_WRITE_ZEROES request is an
+//           array of these, one per range of sectors.
+
+struct vioblk_range {
+    uint64_t sector;
+    uint32_t num_sectors;
+    uint32_t flags;
+};
+
+//           Packed virtqueue descriptor and event suppression structure. With
+//           VIOBLK_RING_PACKED the descriptors are used both in the ring and in the slots'
+//           indirect tables.
+
+struct vioblk_pdesc {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+};
+
+struct vioblk_pevent {
+    uint16_t off_wrap;
+    uint16_t flags;
+};
 
 //           Status byte values
 
@@ -70,6 +204,118 @@ struct vioblk_request_header {
 
 // static struct lock vioblk_lock;
 
+//           One request slot. Each slot owns an indirect descriptor table (header, up to
+//           VIOBLK_MAXSEG data descriptors, status), a request header and a status byte, so
+//           requests in different slots never share anything.
+
+struct vioblk_slot {
+    //           signaled from ISR when this slot's request completes
+    struct condition done;
+    union {
+        struct virtq_desc desc[VIOBLK_MAXSEG + 2];
+        //           the same table for a packed ring; addr and len sit where they do in
+        //           desc, so only vioblk_chain has to know which one the device reads
+        struct vioblk_pdesc pdesc[VIOBLK_MAXSEG + 2];
+    };
+    struct vioblk_request_header req_header;
+    uint8_t req_status;
+    int8_t busy; // submitted and not completed yet
+    int8_t inuse; // owned by a thread
+
+    //           the request as the scheduler sees it
+    int nseg; // data descriptors
+    uint64_t nsect; // sectors of data
+    uint64_t stamp; // rdtime() when it was queued
+    uint64_t notified; // rdtime() when it was handed to the device
+    uint64_t completed; // rdtime() when its completion was handled
+    struct vioblk_slot * next; // in the pending list, or in a riders list
+    struct vioblk_slot * riders; // requests merged into this one, completed with it
+    struct vioblk_queue * vq; // queue the slot belongs to
+};
+
+//           One resident sector. Partial-sector reads and writes go through these instead
+//           of the device, so back-to-back small writes to a sector only cost one request
+//           when the sector is written back (evicted, flushed or the device is closed).
+
+struct vioblk_sector {
+    uint64_t sector;
+    uint32_t stamp; // dev->scache_clock at last use, smallest gets evicted
+    int8_t valid;
+    int8_t dirty; // newer than the device
+    char * data; // blksz bytes
+};
+
+//           One virtqueue with its request slots and request scheduler. With
+//           VIRTIO_BLK_F_MQ the device has several, and a thread always submits through the
+//           same one (vioblk_queue_of), so threads on different queues share no ring, slot or
+//           scheduler state. All of it is used by the ISR as well, so it is only touched with
+//           interrupts disabled.
+
+struct vioblk_queue {
+    uint16_t qid;
+    //           number of ring entries in use (power of two, at most VIOBLK_QLEN)
+    uint16_t len;
+    //           slots not owned by any thread, and a condition signaled when one is given back
+    uint16_t nfree;
+    struct condition slot_freed;
+
+#ifdef VIOBLK_RING_PACKED
+    //           ring entry the next request goes in and the one its completion shows up
+    //           in next, each with the wrap counter that marks an entry as available or used
+    //           on the current pass over the ring
+    uint16_t next_avail;
+    uint16_t next_used;
+    int8_t avail_wrap;
+    int8_t used_wrap;
+
+    volatile struct vioblk_pevent driver_event __attribute__ ((aligned (4)));
+    volatile struct vioblk_pevent device_event __attribute__ ((aligned (4)));
+
+    //           Each request takes one entry: an indirect descriptor pointing at its slot's
+    //           table, with the slot number as buffer id. The device writes the completion
+    //           over an entry in the same ring, so submitting and completing a request
+    //           touches a single 16-byte entry.
+
+    volatile struct vioblk_pdesc ring[VIOBLK_QLEN] __attribute__ ((aligned (16)));
+#else
+    //           used ring index up to which completions have been handled
+    uint16_t last_used;
+
+    union {
+        struct virtq_avail avail;
+        //           room for used_event after the ring, whether or not the size
+        //           macro counts it
+        char _avail_filler[VIRTQ_AVAIL_SIZE(VIOBLK_QLEN) + sizeof(uint16_t)];
+    };
+
+    union {
+        volatile struct virtq_used used;
+        //           same for avail_event
+        char _used_filler[VIRTQ_USED_SIZE(VIOBLK_QLEN) + sizeof(uint16_t)];
+    };
+
+    //           Descriptor i is an indirect descriptor pointing at slot i's table, so the
+    //           id in a used ring element is the number of the slot that completed.
+
+    struct virtq_desc desc[VIOBLK_QLEN] __attribute__ ((aligned (16)));
+#endif
+    struct vioblk_slot slots[VIOBLK_QLEN];
+
+    //           Request scheduler
+
+    struct {
+        //           requests handed to the device and not completed, and the most allowed
+        uint16_t inflight;
+        uint16_t depth;
+        //           sector after the last request dispatched; the elevator continues from here
+        uint64_t headpos;
+        //           queued requests not handed to the device yet, oldest first
+        struct vioblk_slot * pending;
+        //           counters; the policy field isn't used here
+        struct io_schedstats stats;
+    } sched;
+};
+
 struct vioblk_device {
     volatile struct virtio_mmio_regs * regs;
     struct io_intf io_intf;
@@ -77,47 +323,54 @@ struct vioblk_device {
     uint16_t irqno;
     int8_t opened;
     int8_t readonly;
+    int8_t flushable; // VIRTIO_BLK_F_FLUSH negotiated, writes may sit in a device cache
+    int8_t event_idx; // VIRTIO_F_EVENT_IDX negotiated, see vioblk_intr_arm and vioblk_need_notify
 
     //           optimal block size
     uint32_t blksz;
-    //           current position
+    //           current position, and the lock protecting it for the read/write/seek
+    //           interface; positional transfers don't need it
     uint64_t pos;
+    struct lock pos_lock;
     //           sizeo of device in bytes
     uint64_t size;
     //           size of device in blksz blocks
     uint64_t blkcnt;
-
-    struct {
-        //           signaled from ISR
-        struct condition used_updated;
-
-        //           We use a simple scheme of one transaction at a time.
-
-        union {
-            struct virtq_avail avail;
-            char _avail_filler[VIRTQ_AVAIL_SIZE(1)];
-        };
-
-        union {
-            volatile struct virtq_used used;
-            char _used_filler[VIRTQ_USED_SIZE(1)];
-        };
-
-        //           The first descriptor is an indirect descriptor and is the one used in
-        //           the avail and used rings. The second descriptor points to the header,
-        //           the third points to the data, and the fourth to the status byte.
-
-        struct virtq_desc desc[4];
-        struct vioblk_request_header req_header;
-        uint8_t req_status;
-    } vq;
-
-    //           Block currently in block buffer
-    uint64_t bufblkno;
-    //           Block buffer
-    char * blkbuf;
-
-    struct lock dev_lock;
+    //           most data descriptors per request, and most bytes per data descriptor
+    uint32_t seg_max;
+    uint32_t size_max;
+    //           most sectors per range and ranges per request for VIRTIO_BLK_T_DISCARD and
+    //           VIRTIO_BLK_T_WRITE_ZEROES; 0 sectors if the device can't do it
+    uint32_t discard_max;
+    uint32_t discard_seg;
+    uint32_t zeroes_max;
+    uint32_t zeroes_seg;
+
+    //           number of virtqueues (VIRTIO_BLK_F_MQ) and scheduler policy used on all of them
+    uint16_t nq;
+    int sched_policy;
+
+    //           Busy-poll budget for vioblk_poll (0 means sleep right away), and per-request
+    //           latency histograms for each way of waiting. Only touched with interrupts
+    //           disabled.
+
+    unsigned long poll_us;
+    uint64_t poll_ticks;
+    uint64_t latcnt[IO_WAIT_NMODE];
+    uint64_t lathist[IO_WAIT_NMODE][VIOBLK_LATBUCKETS];
+
+    //           request counters and per-stage latency histograms (IOCTL_GETSTATS), also
+    //           only touched with interrupts disabled
+    struct io_blkstats stats;
+
+    //           sector cache, and the lock held while using it (including the requests
+    //           that fill or write back an entry)
+    struct lock scache_lock;
+    uint32_t scache_clock;
+    struct vioblk_sector scache[VIOBLK_SCACHE];
+
+    //           nq queues, followed by the sector cache's buffers
+    struct vioblk_queue vq[];
 };
 
 //           INTERNAL FUNCTION DECLARATIONS
@@ -142,6 +395,72 @@ static int vioblk_ioctl (
 
 static void vioblk_isr(int irqno, void * aux);
 
+static struct vioblk_queue * vioblk_queue_of(struct vioblk_device * dev);
+static struct vioblk_slot * vioblk_slot_get(struct vioblk_device * dev);
+static void vioblk_slot_put(struct vioblk_device * dev, struct vioblk_slot * slot);
+static int vioblk_submit (
+    struct vioblk_device * dev, struct vioblk_slot * slot,
+    uint32_t type, uint64_t sector, int nseg);
+static void vioblk_chain(struct vioblk_device * dev, struct vioblk_slot * slot);
+static void vioblk_sched_add(struct vioblk_device * dev, struct vioblk_slot * slot);
+static int vioblk_sched_merge (
+    struct vioblk_device * dev, struct vioblk_slot * q, struct vioblk_slot * slot);
+static struct vioblk_slot ** vioblk_sched_pick (
+    struct vioblk_device * dev, struct vioblk_queue * vq);
+static void vioblk_sched_dispatch(struct vioblk_device * dev, struct vioblk_queue * vq);
+static void vioblk_complete(struct vioblk_device * dev, struct vioblk_queue * vq);
+static void vioblk_poll(struct vioblk_device * dev, struct vioblk_slot * slot);
+static void vioblk_intr_arm(struct vioblk_device * dev, struct vioblk_queue * vq);
+static void vioblk_ring_publish(struct vioblk_queue * vq, struct vioblk_slot * slot);
+static int vioblk_ring_has_used(struct vioblk_queue * vq);
+static int vioblk_ring_next_used(struct vioblk_queue * vq);
+static void vioblk_ring_intr(struct vioblk_device * dev, struct vioblk_queue * vq, int enable);
+static int vioblk_need_notify (
+    struct vioblk_device * dev, struct vioblk_queue * vq, uint16_t npub);
+static int vioblk_lat_bucket(uint64_t ticks);
+static void vioblk_account (
+    struct vioblk_device * dev, const struct vioblk_slot * slot, uint64_t nsect);
+static void vioblk_ring_reset(struct vioblk_queue * vq);
+#ifndef VIOBLK_RING_PACKED
+static volatile uint16_t * vioblk_used_event(struct vioblk_queue * vq);
+static volatile uint16_t * vioblk_avail_event(struct vioblk_queue * vq);
+#endif
+static int vioblk_map_buf (
+    struct vioblk_device * dev, struct vioblk_slot * slot,
+    const void * buf, unsigned long * lenptr, int device_writes);
+static void vioblk_map_sector (
+    struct vioblk_device * dev, struct vioblk_slot * slot, char * data);
+static struct vioblk_sector * vioblk_scache_get (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t sector, int fill);
+static int vioblk_scache_writeback (
+    struct vioblk_device * dev, struct vioblk_slot * slot, struct vioblk_sector * ent);
+static int vioblk_scache_flush(struct vioblk_device * dev);
+static void vioblk_scache_update (
+    struct vioblk_device * dev, uint64_t pos, const void * buf, unsigned long len);
+static void vioblk_scache_overlay (
+    struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long len);
+static int vioblk_scache_dirty_in (
+    struct vioblk_device * dev, uint64_t pos, unsigned long len);
+static int vioblk_range(struct vioblk_device * dev, int cmd, const struct io_range * rg);
+static int vioblk_scache_zero (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t pos, unsigned long len);
+static int vioblk_zero_fill (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t first, uint64_t last);
+static uint32_t vioblk_config_read32 (
+    volatile struct virtio_mmio_regs * regs, unsigned int off);
+static uint16_t vioblk_config_read16 (
+    volatile struct virtio_mmio_regs * regs, unsigned int off);
+
+// IMPORTED FUNCTION DECLARATIONS
+//
+
+extern uintptr_t memory_translate(const void * vp, uint_fast8_t rwxug_flags); // memory.c
+extern int memory_prepare_user_write(void * buf, size_t len); // memory.c
+static long vioblk_read_at (
+    struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long bufsz);
+static long vioblk_write_at (
+    struct vioblk_device * dev, uint64_t pos, const void * buf, unsigned long n);
+
 //           IOCTLs
 
 static int vioblk_getlen(const struct vioblk_device * dev, uint64_t * lenptr);
@@ -149,6 +468,14 @@ static int vioblk_getpos(const struct vioblk_device * dev, uint64_t * posptr);
 static int vioblk_setpos(struct vioblk_device * dev, const uint64_t * posptr);
 static int vioblk_getblksz (
     const struct vioblk_device * dev, uint32_t * blkszptr);
+static int vioblk_getschedstats (
+    const struct vioblk_device * dev, struct io_schedstats * statsptr);
+static int vioblk_setsched(struct vioblk_device * dev, const int * policyptr);
+static int vioblk_getlatstats (
+    const struct vioblk_device * dev, struct io_latstats * statsptr);
+static int vioblk_setpoll(struct vioblk_device * dev, const unsigned long * usptr);
+static int vioblk_getstats (
+    const struct vioblk_device * dev, struct io_blkstats * statsptr);
 
 //           EXPORTED FUNCTION DEFINITIONS
 //          
@@ -168,14 +495,17 @@ and device are registered.*/
         - blksz (given)
         - blkcnt (from regs)
         - size (blkcnt * blksz)
-        - blkbuf (points directly below itself in the struct)
+        - queues (as many as the device has, up to VIOBLK_MAXQ, right after the struct), each with
+          its request slots and scheduler depth (no more requests in flight than there are slots)
+        - scheduler policy
+        - sector cache (each entry gets a sector of the space right after the queues)
         - irqno (given)
         - io_intf (initialized at the top of the function)
     set descriptors
     reset virtq using the given virtio_reset_virtq funciton. This is called in open so it's probably redundant
     reset idx and flags for avail and used vq's - also done in open so probably unnecessary
     attach virtqueues
-    initialize used_updated condition - I enabled and disabled interrupts before/after but not sure if it's needed
+    initialize slot conditions - I enabled and disabled interrupts before/after but not sure if it's needed
     register isr, register device and set driver_ok status to show it was attached
 
 */
@@ -210,16 +540,34 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
     //           Negotiate features. We need:
     //            - VIRTIO_F_RING_RESET and
     //            - VIRTIO_F_INDIRECT_DESC
+    //            - VIRTIO_F_RING_PACKED with VIOBLK_RING_PACKED
     //           We want:
-    //            - VIRTIO_BLK_F_BLK_SIZE and
-    //            - VIRTIO_BLK_F_TOPOLOGY.
+    //            - VIRTIO_BLK_F_BLK_SIZE,
+    //            - VIRTIO_BLK_F_TOPOLOGY,
+    //            - VIRTIO_BLK_F_SEG_MAX,
+    //            - VIRTIO_BLK_F_SIZE_MAX,
+    //            - VIRTIO_BLK_F_FLUSH,
+    //            - VIRTIO_BLK_F_MQ,
+    //            - VIRTIO_BLK_F_DISCARD,
+    //            - VIRTIO_BLK_F_WRITE_ZEROES and
+    //            - VIRTIO_F_EVENT_IDX.
 
     virtio_featset_init(needed_features);
     virtio_featset_add(needed_features, VIRTIO_F_RING_RESET);
     virtio_featset_add(needed_features, VIRTIO_F_INDIRECT_DESC);
+#ifdef VIOBLK_RING_PACKED
+    virtio_featset_add(needed_features, VIRTIO_F_RING_PACKED);
+#endif
     virtio_featset_init(wanted_features);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_BLK_SIZE);
     virtio_featset_add(wanted_features, VIRTIO_BLK_F_TOPOLOGY);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_FLUSH);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SEG_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_SIZE_MAX);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_MQ);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_DISCARD);
+    virtio_featset_add(wanted_features, VIRTIO_BLK_F_WRITE_ZEROES);
+    virtio_featset_add(wanted_features, VIRTIO_F_EVENT_IDX);
     result = virtio_negotiate_features(regs,
         enabled_features, wanted_features, needed_features);
 
@@ -237,49 +585,114 @@ void vioblk_attach(volatile struct virtio_mmio_regs * regs, int irqno) {
 
     debug("%p: virtio block device block size is %lu", regs, (long)blksz);
 
+    //           Use as many queues as the device has, up to VIOBLK_MAXQ.
+
+    uint_fast16_t nq = 1;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_MQ)) {
+        nq = vioblk_config_read16(regs, VIRTIO_BLK_CFG_NUM_QUEUES);
+        if (nq > VIOBLK_MAXQ) nq = VIOBLK_MAXQ;
+        if (nq == 0) nq = 1;
+    }
+
     //           Allocate initialize device struct
 
-    dev = kmalloc(sizeof(struct vioblk_device) + blksz);
-    memset(dev, 0, sizeof(struct vioblk_device));
+    dev = kmalloc(sizeof(struct vioblk_device) + nq * sizeof(struct vioblk_queue) + VIOBLK_SCACHE * blksz);
+    memset(dev, 0, sizeof(struct vioblk_device) + nq * sizeof(struct vioblk_queue));
     //           FIXME Finish initialization of vioblk device here
 
-    lock_init(&vio_lock, "vioblk_lock");
+    lock_init(&dev->pos_lock, "vioblk_lock");
+    lock_init(&dev->scache_lock, "vioblk_scache_lock");
     dev->regs = regs;   //attach regs
     dev->blkcnt = regs->config.blk.capacity;
     dev->blksz = blksz; //set block size
     dev->size = dev->blkcnt * dev->blksz;
-    dev->blkbuf = (char*)&(dev->blkbuf) + sizeof(char*);
     dev->irqno = irqno; //set irqno
     dev->io_intf.ops = &virtio_ops; //set io ops
+    dev->nq = nq;
+    dev->sched_policy = VIOBLK_SCHED;
+    dev->flushable = virtio_featset_test(enabled_features, VIRTIO_BLK_F_FLUSH);
+    dev->event_idx = virtio_featset_test(enabled_features, VIRTIO_F_EVENT_IDX);
+    dev->poll_us = VIOBLK_POLL_US;
+    dev->poll_ticks = VIOBLK_POLL_US * (TIMER_FREQ / 1000000);
+
+    //limits on how a request's data may be split up, if the device has any
+    dev->seg_max = VIOBLK_MAXSEG;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SEG_MAX)) {
+        uint32_t seg_max = vioblk_config_read32(regs, VIRTIO_BLK_CFG_SEG_MAX);
+        if (seg_max != 0 && seg_max < dev->seg_max)
+            dev->seg_max = seg_max;
+    }
+    dev->size_max = UINT32_MAX;
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_SIZE_MAX)) {
+        uint32_t size_max = vioblk_config_read32(regs, VIRTIO_BLK_CFG_SIZE_MAX);
+        if (size_max >= blksz)
+            dev->size_max = size_max;
+    }
 
-    //set descriptors
-    //the first is the indirect descriptor so set indirect flag - size should be the size of the three other descriptors
-    dev->vq.desc[0] = (struct virtq_desc){(uint64_t)&dev->vq.desc[1], 3 * sizeof(struct virtq_desc), VIRTQ_DESC_F_INDIRECT, 0};
-    //second descriptor points to request header. Should include next flag and point to next desc
-    dev->vq.desc[1] = (struct virtq_desc){(uint64_t)&dev->vq.req_header, sizeof(struct vioblk_request_header), VIRTQ_DESC_F_NEXT, 1};
-    //third descriptor points to buffer. Should include next flag and point to the next descriptor
-    dev->vq.desc[2] = (struct virtq_desc){(uint64_t)dev->blkbuf, dev->blksz, VIRTQ_DESC_F_NEXT, 2}; 
-    //last descriptor points to request status - size should be size of req_status. Includes write only flag
-    dev->vq.desc[3] = (struct virtq_desc){(uint64_t)&dev->vq.req_status, sizeof(dev->vq.req_status), VIRTQ_DESC_F_WRITE, 0};
-    //           The first descriptor is an indirect descriptor and is the one used in
-    //           the avail and used rings. The second descriptor points to the header,
-    //           the third points to the data, and the fourth to the status byte.
-
-    //reset avail virtq - also called in open so probably redundant
-    virtio_reset_virtq(dev->regs, 0);
-
-    dev->vq.avail.idx = 0; //reset idx
-    //reset flags
-    dev->vq.avail.flags = 0;
-    dev->vq.used.flags = 0;
+    //and on discard/write zeroes requests; no more ranges than there are data descriptors
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_DISCARD)) {
+        dev->discard_max = vioblk_config_read32(regs, VIRTIO_BLK_CFG_MAX_DISCARD_SECTORS);
+        dev->discard_seg = vioblk_config_read32(regs, VIRTIO_BLK_CFG_MAX_DISCARD_SEG);
+        if (dev->discard_seg == 0) dev->discard_seg = 1;
+        if (dev->discard_seg > VIOBLK_MAXSEG) dev->discard_seg = VIOBLK_MAXSEG;
+    }
+    if (virtio_featset_test(enabled_features, VIRTIO_BLK_F_WRITE_ZEROES)) {
+        dev->zeroes_max = vioblk_config_read32(regs, VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SECTORS);
+        dev->zeroes_seg = vioblk_config_read32(regs, VIRTIO_BLK_CFG_MAX_WRITE_ZEROES_SEG);
+        if (dev->zeroes_seg == 0) dev->zeroes_seg = 1;
+        if (dev->zeroes_seg > VIOBLK_MAXSEG) dev->zeroes_seg = VIOBLK_MAXSEG;
+    }
 
-    __sync_synchronize();
+    for (int q = 0; q < dev->nq; q++) {
+        struct vioblk_queue * const vq = &dev->vq[q];
+        vq->qid = q;
+
+        //use as many slots as the device's queue can take
+        regs->queue_sel = q;
+        __sync_synchronize();
+        vq->len = VIOBLK_QLEN;
+        while (vq->len > regs->queue_num_max && vq->len > 1)
+            vq->len /= 2;
+        vq->nfree = vq->len;
+        vq->sched.depth = (VIOBLK_DEPTH < vq->len) ? VIOBLK_DEPTH : vq->len;
+
+        //set descriptors
+        for (int i = 0; i < vq->len; i++) {
+            struct vioblk_slot * const slot = &vq->slots[i];
+            slot->vq = vq;
+#ifndef VIOBLK_RING_PACKED
+            //the ring descriptor is the indirect one - its size is set per request in vioblk_ring_publish
+            vq->desc[i] = (struct virtq_desc){(uint64_t)&slot->desc[0], 0, VIRTQ_DESC_F_INDIRECT, 0};
+#endif
+            //first slot descriptor points to request header. Should include next flag and point to next desc
+            slot->desc[0] = (struct virtq_desc){(uint64_t)&slot->req_header, sizeof(struct vioblk_request_header), VIRTQ_DESC_F_NEXT, 1};
+            //the data descriptors and the status descriptor after them are filled in per request
+        }
+
+        //reset avail virtq - also called in open so probably redundant
+        virtio_reset_virtq(dev->regs, q);
 
-    //attach virtqueues to the register flags
-    virtio_attach_virtq(regs, 0, 1, (uint64_t)(&dev->vq.desc), (uint64_t) (&dev->vq.used), (uint64_t) (&dev->vq.avail));
+        vioblk_ring_reset(vq); //reset idx and flags
+
+        //attach virtqueues to the register flags
+#ifdef VIOBLK_RING_PACKED
+        //the ring takes the place of the descriptor table, the event structures those of the rings
+        virtio_attach_virtq(regs, q, vq->len, (uint64_t)(&vq->ring), (uint64_t) (&vq->device_event), (uint64_t) (&vq->driver_event));
+#else
+        virtio_attach_virtq(regs, q, vq->len, (uint64_t)(&vq->desc), (uint64_t) (&vq->used), (uint64_t) (&vq->avail));
+#endif
+    }
+
+    //the sector cache's buffers sit after the queues; entries start out invalid
+    for (int i = 0; i < VIOBLK_SCACHE; i++)
+        dev->scache[i].data = (char*)&dev->vq[dev->nq] + i * blksz;
 
     int s = intr_disable(); //disable and enable interrupts - probably unnescessary
-    condition_init(&dev->vq.used_updated, "used_updated"); //initialize condition
+    for (int q = 0; q < dev->nq; q++) {
+        condition_init(&dev->vq[q].slot_freed, "vioblk_slot_freed"); //initialize conditions
+        for (int i = 0; i < dev->vq[q].len; i++)
+            condition_init(&dev->vq[q].slots[i].done, "vioblk_done");
+    }
     intr_restore(s);
 
     intr_register_isr(irqno, VIOBLK_IRQ_PRIO, vioblk_isr, dev); 
@@ -310,7 +723,7 @@ vioblk open:
     checks if null and that it hasn't been opened already
     set ioptr to the io functions in the device
     open by setting opened variable to 1
-    enable avail virtq by calling the given virtio_enable_virtq function using 0 as the param to signify avail vq
+    for each queue: enable it by calling the given virtio_enable_virtq function with its queue number,
     set idx to 0 and set flags to 0
     enable interrupts
     return 0 to signify success - main will flag an error if we return anything else
@@ -333,15 +746,16 @@ int vioblk_open(struct io_intf ** ioptr, void * aux) {
 
     dev->opened = 1; //communicate that it is open
 
-    virtio_enable_virtq(dev->regs, 0); 
-    //enable avail virtq
-    
-    
-    dev->vq.avail.idx = 0; //resets avail idx to 0
-    __sync_synchronize();
-    //reset flags - also done in attach so probably not needed
-    dev->vq.used.flags = 0;
-    dev->vq.avail.flags = 0; 
+    for (int q = 0; q < dev->nq; q++) {
+        struct vioblk_queue * const vq = &dev->vq[q];
+
+        vq->sched.inflight = 0;
+        vq->sched.pending = NULL;
+        vioblk_ring_reset(vq); //the queue starts over from the beginning
+
+        virtio_enable_virtq(dev->regs, q);
+        //enable avail virtq
+    }
     intr_enable_irq(dev->irqno); //enable interrupts for our irq
 
     return 0; // MUST return 0
@@ -356,7 +770,7 @@ Resets the virtq avail and virtq used queues and sets necessary flags in vioblk
 /*
 close gets dev from the io ptr using the offset like ioctl
 disables interrupts for our irqno
-resets virtq using the given virtio_reset_virtq function -- pass in 0 to signify the avail vq
+resets each virtq using the given virtio_reset_virtq function with its queue number
 close vioblk by setting opened to 0
 */
 
@@ -375,8 +789,10 @@ void vioblk_close(struct io_intf * io) {
 
     // Only reset and close if no more references exist
     if (dev->io_intf.refcnt == 0) {
+        vioblk_scache_flush(dev); //the last chance for dirty cached sectors to reach the device
         intr_disable_irq(dev->irqno); 
-        virtio_reset_virtq(dev->regs, 0); // reset virtqueue
+        for (int q = 0; q < dev->nq; q++)
+            virtio_reset_virtq(dev->regs, q); // reset virtqueues
         dev->opened = 0; // close
     }
 
@@ -403,11 +819,11 @@ the disk to service the request. Returns the number of bytes successfully read f
         - Disable interrupts and wait for the device to service the request, then re-enable
         - Check for error
         - Set bytes_to_read, which will be min(ev->blksz - sectorpos, bufsz - bytes_read)
-        - copy bytes_to_read bytes from device blkbuf into buf, then increment bytes_read and pos
+        - copy bytes_to_read bytes from the cached sector into buf (partial sectors), then increment bytes_read and pos
 
     Overall effects:
         memory copied from device into buf
-        pos and bufblkno changed
+        pos changed
         returned bytes_read
     
 */
@@ -417,50 +833,13 @@ long vioblk_read (
     void * restrict buf,
     unsigned long bufsz)
 {
-    //           FIXME your code here
-
     struct vioblk_device *dev = (void*)io - offsetof(struct vioblk_device, io_intf); //get device - same way they did in ioctl
-    if (dev->pos >= dev->size || bufsz == 0 || dev->opened == 0) return 0;           //check for obvious errors
-    lock_acquire(&vio_lock);
-    unsigned long bytes_read = 0; //initialize counter
-    dev->vq.desc[2].flags |= VIRTQ_DESC_F_WRITE;  // Set device to write data into driver buffer
-
-    while (bufsz > bytes_read) { //loop until we've read enough bytes
-        dev->bufblkno = dev->pos / dev->blksz;  //get sector number
-        unsigned long sectorpos = dev->pos % dev->blksz;     //get position in the sector
-
-        //header is used by the descriptors
-        dev->vq.req_header.type = VIRTIO_BLK_T_IN;          //set header for data IN (read)
-        dev->vq.req_header.sector = dev->bufblkno;          //set sector number for header
-         
-        //clear head and increment idx
-        dev->vq.avail.ring[0] = 0;
-        //__sync_synchronize();
-        dev->vq.avail.idx += 1;
-        //__sync_synchronize();
-
-        virtio_notify_avail(dev->regs, 0);//notify there is an available virtqueue
-
-        //disable interrupts
-        int s = intr_disable();
-        while (dev->vq.used.idx != dev->vq.avail.idx) condition_wait(&dev->vq.used_updated); //wait for the device to service request
-        intr_restore(s);
-        //restore interrupts after condition satisfied
-        if (dev->vq.req_status != VIRTIO_BLK_S_OK) return -EIO;//ensure success
-
-        //determine bytes_to_read - will never be greater than 512 since blksz - sectorpos maxes out at 512.
-        //uses the min of blksz - sectorpos and bufsz - bytes_read
-        //the first deals with the case where we start after the beginning of the sector
-        //the second deals with the case where we end prior to the end of a sector
-        unsigned long bytes_to_read = (dev->blksz - sectorpos < bufsz - bytes_read) ? dev->blksz - sectorpos : bufsz - bytes_read;
-        //copy bytes_to_read bytes into the buffer, starting at blkbuf + sectorpos
-        memcpy(buf + bytes_read, dev->blkbuf + sectorpos, bytes_to_read);
+    if (dev->opened == 0) return 0; //check for obvious errors
 
-        bytes_read += bytes_to_read; //increment bytes read
-        dev->pos += bytes_to_read; //increment position
-    }
-
-    lock_release(&vio_lock);
+    lock_acquire(&dev->pos_lock);
+    long bytes_read = vioblk_read_at(dev, dev->pos, buf, bufsz);
+    if (bytes_read > 0) dev->pos += bytes_read; //increment position
+    lock_release(&dev->pos_lock);
     return bytes_read;
 }
 
@@ -476,15 +855,16 @@ for the disk to service the request. Returns the number of bytes successfully wr
 /*vioblk continually writes blocks of up to dev->blksz length until n bytes have been written
     - Sets header for receiving data (VIRTIO_BLK_T_OUT) which is passed in descriptors already
     - Set flags to write mode
-    - initialize sector position, bufblkno, avail ring, idx for each loop iteration
+    - initialize sector position, avail ring, idx for each loop iteration
     - disable interrupts, sleep the thread until the request has been processed, then re-enable interrupts
     - Check for errors then determine the number of bytes to write for the iteration
     - copy memory over to the device, dealing with the simple case or annoying cases
+      (a partial sector is read back first so the rest of it is preserved)
     - increment count and pos
 
     Overall effect:
         memory copied from buf into device
-        bufblkno and pos changed
+        pos changed
         number of bytes written is returned
 */
 
@@ -493,90 +873,978 @@ long vioblk_write (
     const void * restrict buf,
     unsigned long n)
 {
-    //           FIXME your code here
-
     struct vioblk_device *dev = (void*)io - offsetof(struct vioblk_device, io_intf); //get device using offsetof
-    if (dev->pos >= dev->size) return 0; //make sure pos isn't too big
+    if (dev->opened == 0) return 0;
 
-    lock_acquire(&vio_lock);
-    unsigned long bytes_written = 0; //initialize counter
-    dev->vq.desc[2].flags &= ~VIRTQ_DESC_F_WRITE;  // Set to write mode
-    char buffer[dev->blksz];//set up buffer for copying data
+    lock_acquire(&dev->pos_lock);
+    long bytes_written = vioblk_write_at(dev, dev->pos, buf, n);
+    if (bytes_written > 0) dev->pos += bytes_written; //increment position
+    lock_release(&dev->pos_lock);
+    return bytes_written; //return number of bytes written
+}
 
-    while (n > bytes_written) {
-        dev->bufblkno = dev->pos / dev->blksz; //get sector no.
-        unsigned long sectorpos = dev->pos % dev->blksz; //get sector pos
-        unsigned long bytes_to_write = (dev->blksz - sectorpos < n - bytes_written) ? dev->blksz - sectorpos : n - bytes_written;
-        //determine number of bytes to write
-        //this is min(blksz - sectorpos, n - bytes_written)
-        //The first arg will never be greater than 512, so our upper bound is valid
-        //The sectorpos deals with cases where we start partway through a sector
-        //The n-bytes_written part deals with cases where we are reaching n bytes written 
-        //and need to stop prior to the end of a sector
-        if (sectorpos > 0 || bytes_to_write < dev->blksz) {
-            //this refers to the annoying cases where we start or end in the middle of a sector
-            lock_release(&vio_lock);
-            if(vioblk_read(io, buffer, dev->blksz) < 0){
-                return -EIO; 
-            } 
-            lock_acquire(&vio_lock);
-            memcpy(buffer + sectorpos, buf+bytes_written, bytes_to_write); 
-            memcpy(dev->blkbuf + sectorpos, buffer, dev->blksz);
-            
-        } else { //this refers to the ideal case where we write from the start of a sector to the end of a sector
-            memcpy(dev->blkbuf, buf + bytes_written, bytes_to_write);
+/*Returns the queue the running thread submits through. Threads are spread over the queues by
+thread id, and a thread sticks to its queue.*/
+static struct vioblk_queue * vioblk_queue_of(struct vioblk_device * dev) {
+    return &dev->vq[running_thread() % dev->nq];
+}
+
+/*Takes a free request slot on the running thread's queue, sleeping until another thread gives one
+back if they're all taken.*/
+static struct vioblk_slot * vioblk_slot_get(struct vioblk_device * dev) {
+    struct vioblk_queue * const vq = vioblk_queue_of(dev);
+    struct vioblk_slot * slot = vq->slots;
+
+    int s = intr_disable();
+    while (vq->nfree == 0) condition_wait(&vq->slot_freed);
+    while (slot->inuse) slot++; //there is one, find it
+    slot->inuse = 1;
+    vq->nfree -= 1;
+    intr_restore(s);
+
+    return slot;
+}
+
+/*Gives a request slot back and wakes a thread waiting for one.*/
+static void vioblk_slot_put(struct vioblk_device * dev, struct vioblk_slot * slot) {
+    struct vioblk_queue * const vq = slot->vq;
+
+    int s = intr_disable();
+    slot->inuse = 0;
+    vq->nfree += 1;
+    condition_broadcast(&vq->slot_freed);
+    intr_restore(s);
+}
+
+/*Sends one request for sector through slot and sleeps until the device has completed that
+request; other threads' requests can be in flight at the same time. The caller has already put
+nseg data descriptors in slot->desc[1..nseg] (vioblk_map_buf or vioblk_map_sector); for
+VIRTIO_BLK_T_IN the device writes into them, for VIRTIO_BLK_T_OUT it reads from them.
+VIRTIO_BLK_T_FLUSH has no data (nseg 0), so the header is chained straight to the status byte.
+The request goes through the scheduler, so it may wait behind others or be merged into another
+request for the sectors next to it.
+
+Returns 0 on success, -EIO if the device reported an error*/
+static int vioblk_submit (
+    struct vioblk_device * dev, struct vioblk_slot * slot,
+    uint32_t type, uint64_t sector, int nseg)
+{
+    //header is used by the descriptors
+    slot->req_header.type = type;
+    slot->req_header.sector = sector;
+
+    slot->nseg = nseg;
+    slot->nsect = 0;
+    if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT) { //others' data isn't sectors
+        for (int i = 1; i <= nseg; i++)
+            slot->nsect += slot->desc[i].len;
+        slot->nsect /= dev->blksz;
+    }
+    slot->riders = NULL;
+    slot->busy = 1;
+    vioblk_chain(dev, slot);
+
+    //queue the request and wait for its completion. Interrupts stay off from here so the ISR
+    //can't mark the slot done before we're waiting on it
+    int s = intr_disable();
+    const int mode = (dev->poll_ticks != 0) ? IO_WAIT_POLL : IO_WAIT_IRQ;
+    const uint64_t start = rdtime();
+    const uint64_t nsect = slot->nsect; //grows if requests get merged into this one
+    vioblk_sched_add(dev, slot);
+    vioblk_sched_dispatch(dev, slot->vq);
+    if (mode == IO_WAIT_POLL) vioblk_poll(dev, slot); //might complete it without sleeping
+    while (slot->busy) condition_wait(&slot->done); //only this slot's completion wakes us
+
+    dev->lathist[mode][vioblk_lat_bucket(rdtime() - start)] += 1;
+    dev->latcnt[mode] += 1;
+    vioblk_account(dev, slot, nsect);
+    intr_restore(s);
+
+    if (slot->req_status != VIRTIO_BLK_S_OK) return -EIO; //ensure success
+    return 0;
+}
+
+/*Chains slot's descriptors header -> data... -> status for its slot->nseg data descriptors. In a
+packed ring's indirect table they simply follow each other, so only the flags are set.*/
+static void vioblk_chain(struct vioblk_device * dev, struct vioblk_slot * slot) {
+    const int nseg = slot->nseg;
+
+#ifdef VIOBLK_RING_PACKED
+    for (int i = 0; i <= nseg; i++) {
+        slot->pdesc[i].id = 0;
+        slot->pdesc[i].flags = 0;
+        if (i > 0 && slot->req_header.type == VIRTIO_BLK_T_IN)
+            slot->pdesc[i].flags = VIRTQ_DESC_F_WRITE; // Set device to write data into driver buffer
+    }
+    slot->pdesc[nseg + 1] = (struct vioblk_pdesc){(uint64_t)&slot->req_status, sizeof(slot->req_status), 0, VIRTQ_DESC_F_WRITE};
+#else
+    for (int i = 1; i <= nseg; i++) {
+        slot->desc[i].flags = VIRTQ_DESC_F_NEXT;
+        if (slot->req_header.type == VIRTIO_BLK_T_IN)
+            slot->desc[i].flags |= VIRTQ_DESC_F_WRITE; // Set device to write data into driver buffer
+        slot->desc[i].next = i + 1;
+    }
+    slot->desc[nseg + 1] = (struct virtq_desc){(uint64_t)&slot->req_status, sizeof(slot->req_status), VIRTQ_DESC_F_WRITE, 0};
+#endif
+}
+
+/*Queues slot's request behind the others that haven't been handed to the device, unless it can be
+merged into one of them (vioblk_sched_merge). Interrupts are disabled.*/
+static void vioblk_sched_add(struct vioblk_device * dev, struct vioblk_slot * slot) {
+    struct vioblk_queue * const vq = slot->vq;
+    struct vioblk_slot ** link = &vq->sched.pending;
+    const uint32_t type = slot->req_header.type;
+
+    vq->sched.stats.pol[dev->sched_policy].requests += 1;
+    slot->stamp = rdtime();
+    slot->next = NULL;
+
+    //queue depth this request sees: everything in flight or queued ahead of it
+    uint64_t depth = vq->sched.inflight;
+    for (struct vioblk_slot * q = vq->sched.pending; q != NULL; q = q->next)
+        depth += 1;
+    dev->stats.depth.samples += 1;
+    dev->stats.depth.sum += depth;
+    if (depth > dev->stats.depth.max) dev->stats.depth.max = depth;
+
+    if (type == VIRTIO_BLK_T_IN || type == VIRTIO_BLK_T_OUT) {
+        for (struct vioblk_slot * q = vq->sched.pending; q != NULL; q = q->next) {
+            if (vioblk_sched_merge(dev, q, slot)) {
+                vq->sched.stats.pol[dev->sched_policy].merges += 1;
+                return;
+            }
         }
-        dev->vq.desc[2].flags &= ~VIRTQ_DESC_F_WRITE;  // Set to write mode
+    }
 
-        //set req header for descriptors to pass
-        dev->vq.req_header.type = VIRTIO_BLK_T_OUT;
-        dev->vq.req_header.sector = dev->bufblkno; 
-        //reset avail buffer
-        dev->vq.avail.ring[0] = 0;
-        __sync_synchronize();
-        //increment idx
-        dev->vq.avail.idx += 1;
+    while (*link != NULL) link = &(*link)->next;
+    *link = slot;
+}
+
+/*Merges slot's request into the queued request q if they are the same type and slot's sectors come
+right before or after q's: slot's data descriptors are copied into q's table (in front of or behind
+q's own) so one request moves both, and slot becomes one of q's riders, completed by the ISR along
+with q. The combined request still has to fit in the device's seg_max.
+
+Returns 1 if merged, 0 if not*/
+static int vioblk_sched_merge (
+    struct vioblk_device * dev, struct vioblk_slot * q, struct vioblk_slot * slot)
+{
+    if (q->req_header.type != slot->req_header.type) return 0;
+    if (q->nseg + slot->nseg > dev->seg_max) return 0;
+
+    if (q->req_header.sector + q->nsect == slot->req_header.sector) {
+        //back merge, slot's data goes after q's
+        memcpy(&q->desc[q->nseg + 1], &slot->desc[1], slot->nseg * sizeof(struct virtq_desc));
+    } else if (slot->req_header.sector + slot->nsect == q->req_header.sector) {
+        //front merge, slot's data goes before q's and q starts where slot did
+        for (int i = q->nseg; i >= 1; i--) //make room, from the end so nothing is overwritten
+            q->desc[i + slot->nseg] = q->desc[i];
+        memcpy(&q->desc[1], &slot->desc[1], slot->nseg * sizeof(struct virtq_desc));
+        q->req_header.sector = slot->req_header.sector;
+    } else {
+        return 0;
+    }
+
+    q->nseg += slot->nseg;
+    q->nsect += slot->nsect;
+    vioblk_chain(dev, q);
+
+    slot->next = q->riders;
+    q->riders = slot;
+    return 1;
+}
+
+/*Chooses which queued request goes to the device next. NOOP takes the oldest. ELEVATOR takes the
+oldest too if it has waited longer than VIOBLK_DEADLINE_MS, and otherwise the one with the lowest
+sector at or above where the last request ended, wrapping around to the lowest sector overall when
+there is none, so the device sees sectors in ascending sweeps. The pending list isn't empty.
+
+Returns the link to the chosen request in the pending list*/
+static struct vioblk_slot ** vioblk_sched_pick(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    struct vioblk_slot ** const oldest = &vq->sched.pending;
+    struct vioblk_slot ** up = NULL;
+    struct vioblk_slot ** low = oldest;
+
+    if (dev->sched_policy == IO_SCHED_NOOP) return oldest;
+    if (rdtime() - (*oldest)->stamp > VIOBLK_DEADLINE_MS * (TIMER_FREQ / 1000)) return oldest;
+
+    for (struct vioblk_slot ** link = oldest; *link != NULL; link = &(*link)->next) {
+        const uint64_t sector = (*link)->req_header.sector;
+        if (sector >= vq->sched.headpos && (up == NULL || sector < (*up)->req_header.sector))
+            up = link;
+        if (sector < (*low)->req_header.sector)
+            low = link;
+    }
+
+    return (up != NULL) ? up : low;
+}
+
+/*Hands requests queued on vq to the device, in the order the policy picks, until vq->sched.depth
+are in flight, and notifies the device if any went out. Interrupts are disabled (vioblk_submit, and
+the ISR when a completion makes room).*/
+static void vioblk_sched_dispatch(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    uint16_t published = 0;
+
+    while (vq->sched.pending != NULL && vq->sched.inflight < vq->sched.depth) {
+        struct vioblk_slot ** const link = vioblk_sched_pick(dev, vq);
+        struct vioblk_slot * const slot = *link;
+        *link = slot->next;
+
+        vq->sched.stats.pol[dev->sched_policy].dispatches += 1;
+        vq->sched.stats.pol[dev->sched_policy].wait += rdtime() - slot->stamp;
+        vq->sched.headpos = slot->req_header.sector + slot->nsect;
+        vq->sched.inflight += 1;
+
+        slot->notified = rdtime();
+        for (struct vioblk_slot * r = slot->riders; r != NULL; r = r->next)
+            r->notified = slot->notified;
+
+        vioblk_ring_publish(vq, slot); //publish the slot's descriptor
+        published += 1;
+    }
+
+    if (published) {
         __sync_synchronize();
-        //notify the device that there is a new available virtqueue
-        virtio_notify_avail(dev->regs, 0);
+        if (vioblk_need_notify(dev, vq, published))
+            virtio_notify_avail(dev->regs, vq->qid); //notify there is an available virtqueue
+    }
+}
+
+/*Handles every completion on vq's ring since the last one handled: the slot named by each
+one is marked done and its thread woken, along with the threads whose requests were merged
+into it. The completions make room in the device, so queued requests are dispatched afterwards.
+Interrupts are disabled (the ISR, or a thread polling in vioblk_poll).*/
+static void vioblk_complete(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    int id;
+
+    while ((id = vioblk_ring_next_used(vq)) >= 0) {
+        struct vioblk_slot * const slot = &vq->slots[id];
+        slot->completed = rdtime();
+        slot->busy = 0;
+        condition_broadcast(&slot->done);
+        //requests merged into this one were done by it too
+        for (struct vioblk_slot * r = slot->riders; r != NULL; r = r->next) {
+            r->req_status = slot->req_status;
+            r->completed = slot->completed;
+            r->busy = 0;
+            condition_broadcast(&r->done);
+        }
+        vq->sched.inflight -= 1;
+    }
+    vioblk_sched_dispatch(dev, vq); //room for queued requests now
+}
+
+/*Busy-waits up to dev->poll_ticks for slot's request to complete, handling completions straight
+off its queue's ring instead of waiting for the interrupt. A short request then costs no interrupt,
+sleep or wakeup. Device interrupts are suppressed while polling (nothing else can run anyway) and
+re-armed afterwards; if the budget runs out the caller sleeps as usual. Interrupts are disabled.*/
+static void vioblk_poll(struct vioblk_device * dev, struct vioblk_slot * slot) {
+    struct vioblk_queue * const vq = slot->vq;
+    const uint64_t start = rdtime();
+
+    vioblk_ring_intr(dev, vq, 0);
+    __sync_synchronize();
+
+    while (slot->busy && rdtime() - start < dev->poll_ticks) {
+        if (vioblk_ring_has_used(vq))
+            vioblk_complete(dev, vq);
+    }
+
+    vioblk_intr_arm(dev, vq);
+}
+
+/*Asks the device to interrupt on the next completion on vq after the ones already handled, then
+handles any that slipped in before it could see that (they won't interrupt). Interrupts are
+disabled.*/
+static void vioblk_intr_arm(struct vioblk_device * dev, struct vioblk_queue * vq) {
+    vioblk_ring_intr(dev, vq, 1);
+    __sync_synchronize();
+
+    if (vioblk_ring_has_used(vq))
+        vioblk_complete(dev, vq);
+}
+
+//           Ring layout. Everything that depends on whether vq is a split ring (avail and
+//           used rings next to a descriptor table) or, with VIOBLK_RING_PACKED, a packed ring
+//           (one ring of descriptors that the driver and the device both write) is below.
+//           The packed ring keeps a request's submission and completion in one 16-byte
+//           ring entry, so it touches less memory per request.
+
+/*Puts slot's request on vq's ring for the device; the caller notifies the device.*/
+static void vioblk_ring_publish(struct vioblk_queue * vq, struct vioblk_slot * slot) {
+    const uint16_t id = slot - vq->slots;
+
+#ifdef VIOBLK_RING_PACKED
+    volatile struct vioblk_pdesc * const d = &vq->ring[vq->next_avail];
+
+    d->addr = (uint64_t)&slot->pdesc[0];
+    d->len = (slot->nseg + 2) * sizeof(struct vioblk_pdesc);
+    d->id = id;
+    __sync_synchronize(); //the device may take it as soon as the flags say it's available
+    d->flags = VIRTQ_DESC_F_INDIRECT | (vq->avail_wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED);
+
+    if (++vq->next_avail == vq->len) {
+        vq->next_avail = 0;
+        vq->avail_wrap ^= 1;
+    }
+#else
+    vq->desc[id].len = (slot->nseg + 2) * sizeof(struct virtq_desc);
+    vq->avail.ring[vq->avail.idx % vq->len] = id;
+    __sync_synchronize();
+    vq->avail.idx += 1;
+#endif
+}
+
+/*Returns 1 if the device has completed a request on vq that hasn't been taken off the ring with
+vioblk_ring_next_used yet, 0 if not.*/
+static int vioblk_ring_has_used(struct vioblk_queue * vq) {
+#ifdef VIOBLK_RING_PACKED
+    //a used entry has both flags equal to the device's wrap counter, which we track
+    const uint16_t flags = vq->ring[vq->next_used].flags;
+    return !!(flags & VIRTQ_DESC_F_AVAIL) == vq->used_wrap &&
+        !!(flags & VIRTQ_DESC_F_USED) == vq->used_wrap;
+#else
+    return vq->used.idx != vq->last_used;
+#endif
+}
+
+/*Takes the next completion off vq's ring.
+
+Returns the number of the slot whose request completed, -1 if there is none*/
+static int vioblk_ring_next_used(struct vioblk_queue * vq) {
+    int id;
+
+    if (!vioblk_ring_has_used(vq)) return -1;
+    __sync_synchronize(); //the entry is only read after seeing it's there
+
+#ifdef VIOBLK_RING_PACKED
+    id = vq->ring[vq->next_used].id;
+    if (++vq->next_used == vq->len) {
+        vq->next_used = 0;
+        vq->used_wrap ^= 1;
+    }
+#else
+    id = vq->used.ring[vq->last_used % vq->len].id;
+    vq->last_used += 1;
+#endif
+    return id;
+}
+
+/*Turns the device's interrupts for completions on vq off (enable 0), or back on for the next
+completion after the ones already taken off the ring. With EVENT_IDX a split ring moves
+used_event instead of setting VIRTQ_AVAIL_F_NO_INTERRUPT, which the device is free to ignore.*/
+static void vioblk_ring_intr(struct vioblk_device * dev, struct vioblk_queue * vq, int enable) {
+#ifdef VIOBLK_RING_PACKED
+    vq->driver_event.flags = enable ? VIRTQ_RING_EVENT_ENABLE : VIRTQ_RING_EVENT_DISABLE;
+#else
+    if (dev->event_idx)
+        *vioblk_used_event(vq) = enable ? vq->last_used : vq->last_used - 1; //-1: not for 65535 more
+    else if (enable)
+        vq->avail.flags &= ~VIRTQ_AVAIL_F_NO_INTERRUPT;
+    else
+        vq->avail.flags |= VIRTQ_AVAIL_F_NO_INTERRUPT;
+#endif
+}
+
+/*Decides whether the device has to be notified after npub requests were just published on vq.
+With EVENT_IDX the device says which avail index it wants to hear about (avail_event) and is
+notified only if that one was just published; otherwise it can ask for no notifications while it
+is still working through the ring.
+
+Returns 1 if it has to be notified, 0 if not*/
+static int vioblk_need_notify (
+    struct vioblk_device * dev, struct vioblk_queue * vq, uint16_t npub)
+{
+#ifdef VIOBLK_RING_PACKED
+    //a specific descriptor (VIRTQ_RING_EVENT_DESC) is treated like ENABLE, which only
+    //notifies more often than needed
+    return vq->device_event.flags != VIRTQ_RING_EVENT_DISABLE;
+#else
+    const uint16_t new_idx = vq->avail.idx;
+    const uint16_t old_idx = new_idx - npub;
+
+    if (dev->event_idx)
+        return (uint16_t)(new_idx - *vioblk_avail_event(vq) - 1) < (uint16_t)(new_idx - old_idx);
+    return !(vq->used.flags & VIRTQ_USED_F_NO_NOTIFY);
+#endif
+}
+
+/*Histogram bucket for a latency of ticks: floor(log2(ticks)), the last bucket for anything
+longer.*/
+static int vioblk_lat_bucket(uint64_t ticks) {
+    int b = 0;
+
+    while (ticks >>= 1) b++;
+    if (b >= VIOBLK_LATBUCKETS) b = VIOBLK_LATBUCKETS - 1;
+    return b;
+}
+
+/*Adds slot's request, which just woke its thread, to dev->stats: its type, its nsect sectors
+(as submitted, before anything was merged into it) and status, and the time it spent in each stage
+from the stamps taken at submit (slot->stamp), notify and completion. Interrupts are disabled.*/
+static void vioblk_account (
+    struct vioblk_device * dev, const struct vioblk_slot * slot, uint64_t nsect)
+{
+    const uint64_t woken = rdtime();
+    const uint64_t ticks[IO_STAGE_N] = {
+        [IO_STAGE_QUEUE] = slot->notified - slot->stamp,
+        [IO_STAGE_DEVICE] = slot->completed - slot->notified,
+        [IO_STAGE_WAKEUP] = woken - slot->completed,
+        [IO_STAGE_TOTAL] = woken - slot->stamp
+    };
+
+    if (slot->req_header.type == VIRTIO_BLK_T_IN) {
+        dev->stats.reads += 1;
+        dev->stats.rbytes += nsect * dev->blksz;
+    } else if (slot->req_header.type == VIRTIO_BLK_T_OUT) {
+        dev->stats.writes += 1;
+        dev->stats.wbytes += nsect * dev->blksz;
+    }
+    if (slot->req_status != VIRTIO_BLK_S_OK)
+        dev->stats.errors += 1;
+
+    for (int i = 0; i < IO_STAGE_N; i++) {
+        dev->stats.stage[i].total += ticks[i];
+        dev->stats.stage[i].hist[vioblk_lat_bucket(ticks[i])] += 1;
+    }
+}
+
+/*Gets vq's ring ready for a fresh start: nothing published or used yet, interrupts wanted from the
+first completion on. Used at attach and open, before the queue is enabled.*/
+static void vioblk_ring_reset(struct vioblk_queue * vq) {
+#ifdef VIOBLK_RING_PACKED
+    memset((void *)vq->ring, 0, sizeof(vq->ring)); //no entry looks available or used
+    vq->next_avail = 0;
+    vq->next_used = 0;
+    vq->avail_wrap = 1;
+    vq->used_wrap = 1;
+    vq->driver_event.flags = VIRTQ_RING_EVENT_ENABLE;
+#else
+    vq->avail.idx = 0; //reset idx
+    vq->used.idx = 0; //the queue starts over from the beginning
+    vq->last_used = 0;
+    //reset flags
+    vq->avail.flags = 0;
+    vq->used.flags = 0;
+    *vioblk_used_event(vq) = 0; //interrupt on the first completion
+#endif
+    __sync_synchronize();
+}
+
+#ifndef VIOBLK_RING_PACKED
+
+/*vq's used_event field, right after the avail ring's vq->len entries.*/
+static volatile uint16_t * vioblk_used_event(struct vioblk_queue * vq) {
+    return (volatile uint16_t *)&vq->avail.ring[vq->len];
+}
+
+/*vq's avail_event field, right after the used ring's vq->len elements.*/
+static volatile uint16_t * vioblk_avail_event(struct vioblk_queue * vq) {
+    return (volatile uint16_t *)&vq->used.ring[vq->len];
+}
+
+#endif
+
+/*Points slot's data descriptors straight at the physical pages behind buf so the device transfers
+to/from it without a copy. buf may be a kernel or a user address; user pages are translated through
+the active page table, and have to be writable if the device is going to write into them
+(device_writes). *lenptr (a multiple of blksz) is how much the caller wants to move; it is cut down
+to what fits in the device's seg_max/size_max limits, stops at the first page that isn't mapped yet,
+and stays a multiple of blksz. Pieces of the buffer that are physically adjacent share a descriptor.
+
+Returns the number of data descriptors used, 0 if not even one sector fits (caller goes through
+the sector cache)*/
+static int vioblk_map_buf (
+    struct vioblk_device * dev, struct vioblk_slot * slot,
+    const void * buf, unsigned long * lenptr, int device_writes)
+{
+    unsigned long len = *lenptr;
+    unsigned long done = 0; //bytes covered by descriptors so far
+    int nseg = 0;
+
+    while (done < len) {
+        const void * vp = buf + done;
+        unsigned long chunk = PAGE_SIZE - (uintptr_t)vp % PAGE_SIZE; //never cross a page in one step
+        if (chunk > len - done) chunk = len - done;
+
+        uintptr_t addr = memory_translate(vp, device_writes ? PTE_W : PTE_R); //physical address for the device
+        if (addr == 0) break; //not mapped (with those permissions): goes through the sector cache
+
+        struct virtq_desc * last = &slot->desc[nseg];
+        if (nseg > 0 && last->addr + last->len == addr && last->len + chunk <= dev->size_max) {
+            last->len += chunk; //physically follows the previous piece
+        } else {
+            if (nseg == dev->seg_max) break; //out of descriptors, the rest goes in another request
+            if (chunk > dev->size_max) chunk = dev->size_max;
+            nseg += 1;
+            slot->desc[nseg].addr = addr;
+            slot->desc[nseg].len = chunk;
+        }
+        done += chunk;
+    }
+
+    //a request has to be whole sectors: give back the partial one at the end, if any
+    unsigned long excess = done % dev->blksz;
+    while (excess > 0 && nseg > 0) {
+        if (slot->desc[nseg].len > excess) {
+            slot->desc[nseg].len -= excess;
+            excess = 0;
+        } else {
+            excess -= slot->desc[nseg].len;
+            nseg -= 1;
+        }
+    }
+
+    *lenptr = (done / dev->blksz) * dev->blksz;
+    return (*lenptr == 0) ? 0 : nseg;
+}
+
+/*Points slot's only data descriptor at one sector's worth of kernel memory (a sector cache
+entry's buffer).*/
+static void vioblk_map_sector (
+    struct vioblk_device * dev, struct vioblk_slot * slot, char * data)
+{
+    slot->desc[1].addr = (uint64_t)data;
+    slot->desc[1].len = dev->blksz;
+}
+
+/*Returns the sector cache entry holding sector. If the sector isn't resident, the least recently
+used entry (an invalid one if there is one) is taken over: it's written back first if it is dirty,
+and then filled from the device if fill is set - a caller about to overwrite the whole sector
+doesn't need the old contents. Caller holds dev->scache_lock and the request slot used for any
+requests.
+
+Returns NULL if a request failed*/
+static struct vioblk_sector * vioblk_scache_get (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t sector, int fill)
+{
+    struct vioblk_sector * victim = &dev->scache[0];
+
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        struct vioblk_sector * const ent = &dev->scache[i];
+        if (ent->valid && ent->sector == sector) { //hit
+            ent->stamp = ++dev->scache_clock;
+            return ent;
+        }
+        if (!ent->valid)
+            victim = ent;
+        else if (victim->valid && ent->stamp < victim->stamp)
+            victim = ent;
+    }
+
+    if (victim->valid && victim->dirty && vioblk_scache_writeback(dev, slot, victim) != 0)
+        return NULL;
+    victim->valid = 0;
+
+    if (fill) {
+        vioblk_map_sector(dev, slot, victim->data);
+        if (vioblk_submit(dev, slot, VIRTIO_BLK_T_IN, sector, 1) != 0) return NULL;
+    }
+
+    victim->sector = sector;
+    victim->valid = 1;
+    victim->dirty = 0;
+    victim->stamp = ++dev->scache_clock;
+    return victim;
+}
+
+/*Writes a dirty cache entry back to its sector. Caller holds dev->scache_lock and slot.
+
+Returns 0 on success, -EIO if the device reported an error (the entry stays dirty)*/
+static int vioblk_scache_writeback (
+    struct vioblk_device * dev, struct vioblk_slot * slot, struct vioblk_sector * ent)
+{
+    vioblk_map_sector(dev, slot, ent->data);
+    if (vioblk_submit(dev, slot, VIRTIO_BLK_T_OUT, ent->sector, 1) != 0) return -EIO;
+    ent->dirty = 0;
+    return 0;
+}
+
+/*Writes every dirty cached sector back to the device; the entries stay resident. The slot is
+taken before the lock, the same order as vioblk_read_at/vioblk_write_at, so they can't deadlock.
+
+Returns 0 on success, -EIO if any write failed*/
+static int vioblk_scache_flush(struct vioblk_device * dev) {
+    struct vioblk_slot * slot = vioblk_slot_get(dev);
+    int result = 0;
+
+    lock_acquire(&dev->scache_lock);
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        struct vioblk_sector * const ent = &dev->scache[i];
+        if (ent->valid && ent->dirty && vioblk_scache_writeback(dev, slot, ent) != 0)
+            result = -EIO;
+    }
+    lock_release(&dev->scache_lock);
+
+    vioblk_slot_put(dev, slot);
+    return result;
+}
+
+/*Copies whole sectors about to be written straight to the device at pos (sector aligned) into any
+cached copies of them, so the cache never holds older data than the device. Dirty entries stay
+dirty. Caller holds dev->scache_lock.*/
+static void vioblk_scache_update (
+    struct vioblk_device * dev, uint64_t pos, const void * buf, unsigned long len)
+{
+    const uint64_t first = pos / dev->blksz;
+    const uint64_t end = (pos + len) / dev->blksz;
+
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        struct vioblk_sector * const ent = &dev->scache[i];
+        if (ent->valid && first <= ent->sector && ent->sector < end)
+            memcpy(ent->data, buf + (ent->sector - first) * dev->blksz, dev->blksz);
+    }
+}
+
+/*Copies dirty cached sectors over whole sectors just read straight from the device at pos (sector
+aligned): they haven't been written back yet, so the device returned older data. Caller holds
+dev->scache_lock.*/
+static void vioblk_scache_overlay (
+    struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long len)
+{
+    const uint64_t first = pos / dev->blksz;
+    const uint64_t end = (pos + len) / dev->blksz;
+
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        struct vioblk_sector * const ent = &dev->scache[i];
+        if (ent->valid && ent->dirty && first <= ent->sector && ent->sector < end)
+            memcpy(buf + (ent->sector - first) * dev->blksz, ent->data, dev->blksz);
+    }
+}
+
+/*Tells whether any of the whole sectors at pos (sector aligned) has a dirty entry in the sector
+cache. A whole-sector read over such a range keeps dev->scache_lock until its overlay is done, so
+the entry can't be evicted and written back while the request is in flight: that writeback could
+reach the device after the read and leave the overlay nothing to copy. Caller holds
+dev->scache_lock.*/
+static int vioblk_scache_dirty_in (
+    struct vioblk_device * dev, uint64_t pos, unsigned long len)
+{
+    const uint64_t first = pos / dev->blksz;
+    const uint64_t end = (pos + len) / dev->blksz;
+
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        const struct vioblk_sector * const ent = &dev->scache[i];
+        if (ent->valid && ent->dirty && first <= ent->sector && ent->sector < end)
+            return 1;
+    }
+    return 0;
+}
+
+/*Positional read: like vioblk_read but starts at pos and leaves dev->pos alone. Reads are cut
+short at the end of the device. Whole sectors go straight into buf (kernel or user memory), as few
+requests as the device's limits allow; only partial sectors at the ends are served from the sector
+cache. Needs no lock apart from the sector cache's, each call works in a request slot of its own.
+Copy-on-write user pages in buf are copied first, so vioblk_map_buf can hand them to the device and
+copies out of the sector cache don't fault.*/
+static long vioblk_read_at(struct vioblk_device * dev, uint64_t pos, void * buf, unsigned long bufsz) {
+    if (pos >= dev->size) return 0;
+    if (bufsz > dev->size - pos) bufsz = dev->size - pos;
+    if (memory_prepare_user_write(buf, bufsz) != 0) return -EINVAL;
+
+    struct vioblk_slot * slot = vioblk_slot_get(dev);
+    struct vioblk_sector * ent;
+    unsigned long bytes_read = 0; //initialize counter
+
+    while (bufsz > bytes_read) { //loop until we've read enough bytes
+        unsigned long sectorpos = pos % dev->blksz; //get position in the sector
+        unsigned long bytes_to_read = (bufsz - bytes_read) / dev->blksz * dev->blksz; //whole sectors left
+        int nseg = (sectorpos == 0 && bytes_to_read > 0) ? vioblk_map_buf(dev, slot, buf + bytes_read, &bytes_to_read, 1) : 0;
+
+        if (nseg > 0) {
+            //many sectors, straight into the caller's buffer; dirty cached ones among them stay
+            //put (the lock is kept) until the overlay below has them
+            lock_acquire(&dev->scache_lock);
+            int pinned = vioblk_scache_dirty_in(dev, pos, bytes_to_read);
+            if (!pinned) lock_release(&dev->scache_lock);
+            int result = vioblk_submit(dev, slot, VIRTIO_BLK_T_IN, pos / dev->blksz, nseg);
+            if (!pinned) lock_acquire(&dev->scache_lock);
+            //sectors written into the cache but not back to the device yet are newer
+            if (result == 0) vioblk_scache_overlay(dev, pos, buf + bytes_read, bytes_to_read);
+            lock_release(&dev->scache_lock);
+            if (result != 0) {
+                vioblk_slot_put(dev, slot);
+                return -EIO;
+            }
+        } else {
+            //uses the min of blksz - sectorpos and bufsz - bytes_read
+            //the first deals with the case where we start after the beginning of the sector
+            //the second deals with the case where we end prior to the end of a sector
+            bytes_to_read = (dev->blksz - sectorpos < bufsz - bytes_read) ? dev->blksz - sectorpos : bufsz - bytes_read;
+
+            lock_acquire(&dev->scache_lock);
+            ent = vioblk_scache_get(dev, slot, pos / dev->blksz, 1);
+            //copy bytes_to_read bytes into the buffer, starting at sectorpos in the cached sector
+            if (ent != NULL) memcpy(buf + bytes_read, ent->data + sectorpos, bytes_to_read);
+            lock_release(&dev->scache_lock);
+
+            if (ent == NULL) {
+                vioblk_slot_put(dev, slot);
+                return -EIO;
+            }
+        }
+
+        bytes_read += bytes_to_read; //increment bytes read
+        pos += bytes_to_read;
+    }
+
+    vioblk_slot_put(dev, slot);
+    return bytes_read;
+}
+
+/*Positional write: like vioblk_write but starts at pos and leaves dev->pos alone. Writes are cut
+short at the end of the device. Whole sectors go straight from buf like in vioblk_read_at; partial
+sectors are merged into the sector cache instead of doing a read-modify-write on the device, and
+reach it when the cached sector is written back (evicted, IOCTL_FLUSH or close).*/
+static long vioblk_write_at(struct vioblk_device * dev, uint64_t pos, const void * buf, unsigned long n) {
+    if (pos >= dev->size) return 0; //make sure pos isn't too big
+    if (n > dev->size - pos) n = dev->size - pos;
 
-        //disable interrupts before suspending thread
-        int s = intr_disable();
-        while (dev->vq.used.idx != dev->vq.avail.idx) { //loop until indices match
-            condition_wait(&dev->vq.used_updated); //wait for disk to process request
+    struct vioblk_slot * slot = vioblk_slot_get(dev);
+    struct vioblk_sector * ent;
+    unsigned long bytes_written = 0; //initialize counter
+    int result = 0;
+
+    while (n > bytes_written) {
+        uint64_t sector = pos / dev->blksz; //get sector no.
+        unsigned long sectorpos = pos % dev->blksz; //get sector pos
+        unsigned long bytes_to_write = (n - bytes_written) / dev->blksz * dev->blksz; //whole sectors left
+        int nseg = (sectorpos == 0 && bytes_to_write > 0) ? vioblk_map_buf(dev, slot, buf + bytes_written, &bytes_to_write, 0) : 0;
+
+        if (nseg > 0) {
+            //cached copies take the new data before the device does, so a partial write merged
+            //into one of them afterwards isn't based on the old contents. The lock is kept until
+            //the device has it too: a writeback of such a merge (or a fill for one) can't reach
+            //the device in between and be overwritten by, or miss, this write.
+            lock_acquire(&dev->scache_lock);
+            vioblk_scache_update(dev, pos, buf + bytes_written, bytes_to_write);
+            result = vioblk_submit(dev, slot, VIRTIO_BLK_T_OUT, sector, nseg);
+            lock_release(&dev->scache_lock);
+        } else {
+            //this is min(blksz - sectorpos, n - bytes_written)
+            bytes_to_write = (dev->blksz - sectorpos < n - bytes_written) ? dev->blksz - sectorpos : n - bytes_written;
+
+            //the annoying cases where we start or end in the middle of a sector need the bytes
+            //around the write, so the sector is read in if it isn't cached already
+            lock_acquire(&dev->scache_lock);
+            ent = vioblk_scache_get(dev, slot, sector, sectorpos > 0 || bytes_to_write < dev->blksz);
+            if (ent != NULL) {
+                memcpy(ent->data + sectorpos, buf + bytes_written, bytes_to_write);
+                ent->dirty = 1;
+            } else {
+                result = -EIO;
+            }
+            lock_release(&dev->scache_lock);
         }
-        //restore interrupts to resume execution
-        intr_restore(s);
 
-        //check if an error occurred
-        if (dev->vq.req_status != VIRTIO_BLK_S_OK) return -EIO;
+        if (result != 0) {
+            vioblk_slot_put(dev, slot);
+            return -EIO;
+        }
 
         //increment count and pos by number of bytes written
         bytes_written += bytes_to_write;
-        dev->pos += bytes_to_write;
+        pos += bytes_to_write;
     }
-    lock_release(&vio_lock);
-    return bytes_written; //return number of bytes written
+
+    vioblk_slot_put(dev, slot);
+    return bytes_written;
+}
+
+/*Zeroes (IOCTL_ZERO_RANGE) or discards (IOCTL_DISCARD) the bytes in rg, cut short at the end of
+the device. Whole sectors go to the device as VIRTIO_BLK_T_WRITE_ZEROES/VIRTIO_BLK_T_DISCARD
+requests, each carrying as many ranges (up to the device's per-range sector limit) as it accepts,
+so even a large region usually costs one request. A device without WRITE_ZEROES gets zero-filled
+writes instead (vioblk_zero_fill). Partial sectors at the ends are zeroed in the sector cache; a
+discard leaves them alone, as it only says the data isn't needed any more. Cached copies of the
+whole sectors are zeroed or dropped first so they can't bring the old data back later.
+
+Returns 0 on success, -ENOTSUP if the device can't discard, -EIO if a request failed*/
+static int vioblk_range(struct vioblk_device * dev, int cmd, const struct io_range * rg) {
+    const int zero = (cmd == IOCTL_ZERO_RANGE);
+    const uint32_t max_sectors = zero ? dev->zeroes_max : dev->discard_max;
+    const uint32_t max_seg = zero ? dev->zeroes_seg : dev->discard_seg;
+    struct vioblk_range seg[VIOBLK_MAXSEG]; //only read by the device while we wait in vioblk_submit
+    uint64_t pos = rg->pos;
+    uint64_t end = rg->pos + rg->len;
+    int result = 0;
+
+    if (end > dev->size || end < pos) end = dev->size;
+    if (pos >= end) return 0;
+    if (!zero && max_sectors == 0) return -ENOTSUP;
+
+    uint64_t first = (pos + dev->blksz - 1) / dev->blksz; //first whole sector
+    const uint64_t last = end / dev->blksz; //one past the last whole sector
+
+    struct vioblk_slot * slot = vioblk_slot_get(dev);
+
+    lock_acquire(&dev->scache_lock);
+    if (zero && first > last) { //all inside one sector
+        result = vioblk_scache_zero(dev, slot, pos, end - pos);
+    } else if (zero) {
+        if (pos % dev->blksz != 0)
+            result = vioblk_scache_zero(dev, slot, pos, first * dev->blksz - pos);
+        if (result == 0 && end % dev->blksz != 0)
+            result = vioblk_scache_zero(dev, slot, last * dev->blksz, end - last * dev->blksz);
+    }
+    for (int i = 0; i < VIOBLK_SCACHE; i++) {
+        struct vioblk_sector * const ent = &dev->scache[i];
+        if (!ent->valid || ent->sector < first || ent->sector >= last) continue;
+        if (zero) {
+            memset(ent->data, 0, dev->blksz);
+        } else {
+            ent->valid = 0;
+            ent->dirty = 0;
+        }
+    }
+    lock_release(&dev->scache_lock);
+
+    if (zero && max_sectors == 0) {
+        if (result == 0 && first < last) result = vioblk_zero_fill(dev, slot, first, last);
+        first = last;
+    }
+
+    while (result == 0 && first < last) {
+        uint32_t nseg = 0;
+        while (nseg < max_seg && first < last) {
+            uint64_t cnt = (last - first < max_sectors) ? last - first : max_sectors;
+            seg[nseg++] = (struct vioblk_range){first, cnt, 0};
+            first += cnt;
+        }
+
+        slot->desc[1].addr = (uint64_t)seg;
+        slot->desc[1].len = nseg * sizeof(struct vioblk_range);
+        result = vioblk_submit(dev, slot, zero ? VIRTIO_BLK_T_WRITE_ZEROES : VIRTIO_BLK_T_DISCARD, 0, 1);
+    }
+
+    vioblk_slot_put(dev, slot);
+    return result;
+}
+
+/*Zeroes len bytes at pos, all within one sector, in the sector cache (reading the sector in first
+if it isn't cached); they reach the device when the sector is written back. Caller holds
+dev->scache_lock and slot.
+
+Returns 0 on success, -EIO if a request failed*/
+static int vioblk_scache_zero (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t pos, unsigned long len)
+{
+    struct vioblk_sector * const ent = vioblk_scache_get(dev, slot, pos / dev->blksz, 1);
+
+    if (ent == NULL) return -EIO;
+    memset(ent->data + pos % dev->blksz, 0, len);
+    ent->dirty = 1;
+    return 0;
+}
+
+/*Writes zeroes to sectors first up to last for a device without WRITE_ZEROES. Every data
+descriptor of a request points at the same zeroed page, so a request still covers up to
+seg_max pages' worth of sectors.
+
+Returns 0 on success, -EIO if a request failed*/
+static int vioblk_zero_fill (
+    struct vioblk_device * dev, struct vioblk_slot * slot, uint64_t first, uint64_t last)
+{
+    unsigned long chunk = (PAGE_SIZE < dev->size_max) ? PAGE_SIZE : dev->size_max;
+    char * const zeroes = memory_alloc_page();
+    int result = 0;
+
+    chunk = chunk / dev->blksz * dev->blksz; //whole sectors per descriptor
+    memset(zeroes, 0, PAGE_SIZE);
+
+    while (result == 0 && first < last) {
+        const uint64_t sector = first;
+        uint32_t nseg = 0;
+        while (nseg < dev->seg_max && first < last) {
+            uint64_t cnt = (last - first < chunk / dev->blksz) ? last - first : chunk / dev->blksz;
+            nseg += 1;
+            slot->desc[nseg].addr = (uint64_t)zeroes;
+            slot->desc[nseg].len = cnt * dev->blksz;
+            first += cnt;
+        }
+        result = vioblk_submit(dev, slot, VIRTIO_BLK_T_OUT, sector, nseg);
+    }
+
+    memory_free_page(zeroes);
+    return result;
+}
+
+/*Reads a 32-bit field of the device configuration space at byte offset off.*/
+static uint32_t vioblk_config_read32 (
+    volatile struct virtio_mmio_regs * regs, unsigned int off)
+{
+    return *(volatile uint32_t *)((volatile char *)&regs->config + off);
+}
+
+/*Reads a 16-bit field of the device configuration space at byte offset off.*/
+static uint16_t vioblk_config_read16 (
+    volatile struct virtio_mmio_regs * regs, unsigned int off)
+{
+    return *(volatile uint16_t *)((volatile char *)&regs->config + off);
 }
 
 int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
     struct vioblk_device * const dev = (void*)io -
         offsetof(struct vioblk_device, io_intf);
+    struct io_posrw * rw = arg;
 
     //trace("%s(cmd=%d,arg=%p)", __func__, cmd, arg);
-    int ret = -1;
+    int ret = -ENOTSUP;
 
     switch (cmd) {
     case IOCTL_GETLEN:
         ret = vioblk_getlen(dev, arg);
+        break;
     case IOCTL_GETPOS:
         ret = vioblk_getpos(dev, arg);
+        break;
     case IOCTL_SETPOS:
-        lock_acquire(&vio_lock);
+        lock_acquire(&dev->pos_lock);
         ret = vioblk_setpos(dev, arg);
-        lock_release(&vio_lock);
+        lock_release(&dev->pos_lock);
+        break;
     case IOCTL_GETBLKSZ:
         ret = vioblk_getblksz(dev, arg);
+        break;
+    case IOCTL_FLUSH:
+        //dirty cached sectors first, then the device's own write cache
+        ret = vioblk_scache_flush(dev);
+        //without a device write cache every completed write is already stable
+        if (ret != 0 || !dev->flushable) break;
+        {
+            struct vioblk_slot * slot = vioblk_slot_get(dev);
+            ret = vioblk_submit(dev, slot, VIRTIO_BLK_T_FLUSH, 0, 0);
+            vioblk_slot_put(dev, slot);
+        }
+        break;
+    case IOCTL_GETSCHEDSTATS:
+        ret = vioblk_getschedstats(dev, arg);
+        break;
+    case IOCTL_SETSCHED:
+        ret = vioblk_setsched(dev, arg);
+        break;
+    case IOCTL_GETLATSTATS:
+        ret = vioblk_getlatstats(dev, arg);
+        break;
+    case IOCTL_GETSTATS:
+        ret = vioblk_getstats(dev, arg);
+        break;
+    case IOCTL_SETPOLL:
+        ret = vioblk_setpoll(dev, arg);
+        break;
+    case IOCTL_DISCARD:
+    case IOCTL_ZERO_RANGE:
+        if (arg == NULL) return -EINVAL;
+        ret = vioblk_range(dev, cmd, arg);
+        break;
+    case IOCTL_READAT:
+        if (rw == NULL) return -EINVAL;
+        ret = vioblk_read_at(dev, rw->pos, rw->buf, rw->len);
+        break;
+    case IOCTL_WRITEAT:
+        if (rw == NULL) return -EINVAL;
+        ret = vioblk_write_at(dev, rw->pos, rw->buf, rw->len);
+        break;
     }
     return ret;
 }
@@ -584,35 +1852,31 @@ int vioblk_ioctl(struct io_intf * restrict io, int cmd, void * restrict arg) {
 
 /*interrupt service routine:
 
-gets dev from aux ptr, then checks for interrupt bit 0. We have to acknowledge the interrupt and broadcast
-the condition used_updated to let the driver know that there are more used virtqueues. This is what allows
-read and write to continually happen.
+gets dev from aux ptr, then checks for interrupt bit 0. We have to acknowledge the interrupt and walk
+the used ring from where we left off: every element names the slot whose request completed, so only
+the thread waiting on that slot is woken (along with the threads whose requests were merged into it).
+This is what lets several requests be in flight at once (see vioblk_complete). With EVENT_IDX the
+device only interrupts once used.idx passes used_event, so that is moved up to what was just handled.
 
 Side effects : dev->regs->interrupt_ack changed - The overall effect is small, it just means the system knows
 that the interrupt has been taken care of
 */
 void vioblk_isr(int irqno, void * aux) {
-    //           FIXME your code here
-
     struct vioblk_device * dev = aux;//get device
-    //The device works without dealing with interrupt bit 1 but let's include it anyway
+    uint32_t status = dev->regs->interrupt_status;
 
-    if(dev->regs->interrupt_status & (1<<1)){ //check for bit 1 interrupt
-        //device used a buffer in one of the virtqueues
-        //that means used has been updated
-        __sync_synchronize();
-        condition_broadcast(&dev->vq.used_updated); //broadcast change in used vq
-        dev->regs->interrupt_ack |= (1<<1);         //acknowledge interrupt
-    }
-    if(dev->regs->interrupt_status & (1<<0)){ //check for bit 0 interrupt
-        //the interrupt was asserted because the configuration of the device has changed.
-        //no idea what this means but at least acknowledge it. No clue if this will ever occur
-         __sync_synchronize();
-        condition_broadcast(&dev->vq.used_updated); //signify that used is updated
-        dev->regs->interrupt_ack |= (1<<0); //acknowledge interrupt
-    }
+    dev->regs->interrupt_ack = status; //acknowledge before looking at the ring so nothing is missed
     __sync_synchronize();
 
+    if (status & (1<<1)) { //device used a buffer in one of the virtqueues
+        //there is one interrupt line for all of them, so each queue is checked
+        for (int i = 0; i < dev->nq; i++) {
+            vioblk_complete(dev, &dev->vq[i]); //handle every completion since the last interrupt
+            vioblk_intr_arm(dev, &dev->vq[i]); //and ask for an interrupt on the next one
+        }
+    }
+    //bit 0 means the configuration changed; nothing to do about it beyond acknowledging it
+    __sync_synchronize();
 }
 
 
@@ -678,4 +1942,117 @@ int vioblk_getblksz (
 
 
     return 0;  //return 0 to signal that it was successful
-}
\ No newline at end of file
+}
+
+/*
+copies the scheduler counters for every policy, summed over the queues, into statsptr, working out the average queue wait
+for each, and says which policy is in use.
+returns 0 if successful, invalid if input ptrs are null
+*/
+int vioblk_getschedstats (
+    const struct vioblk_device * dev, struct io_schedstats * statsptr)
+{
+    if (statsptr == NULL || dev == NULL) return -EINVAL;
+
+    int s = intr_disable(); //the ISR updates these
+    memset(statsptr, 0, sizeof(struct io_schedstats));
+    statsptr->policy = dev->sched_policy;
+    for (int q = 0; q < dev->nq; q++) { //summed over the queues
+        for (int i = 0; i < IO_SCHED_NPOLICY; i++) {
+            statsptr->pol[i].requests += dev->vq[q].sched.stats.pol[i].requests;
+            statsptr->pol[i].merges += dev->vq[q].sched.stats.pol[i].merges;
+            statsptr->pol[i].dispatches += dev->vq[q].sched.stats.pol[i].dispatches;
+            statsptr->pol[i].wait += dev->vq[q].sched.stats.pol[i].wait;
+        }
+    }
+    intr_restore(s);
+
+    for (int i = 0; i < IO_SCHED_NPOLICY; i++) {
+        if (statsptr->pol[i].dispatches != 0)
+            statsptr->pol[i].avgwait = statsptr->pol[i].wait / statsptr->pol[i].dispatches;
+    }
+
+    return 0;
+}
+
+/*
+switches the request scheduler to the policy in policyptr. Requests already queued stay queued
+and go out in the new policy's order.
+returns 0 if successful, invalid if the policy doesn't exist or inputs are null
+*/
+int vioblk_setsched(struct vioblk_device * dev, const int * policyptr) {
+    if (policyptr == NULL || dev == NULL) return -EINVAL;
+    if (*policyptr < 0 || *policyptr >= IO_SCHED_NPOLICY) return -EINVAL;
+
+    int s = intr_disable();
+    dev->sched_policy = *policyptr;
+    intr_restore(s);
+
+    return 0;
+}
+
+/*
+works out the 50th and 99th percentile request latency for requests that slept on the interrupt
+and for requests that polled first, from the histograms. A percentile is reported as the upper end
+of the histogram bucket it falls in, in timer ticks.
+returns 0 if successful, invalid if input ptrs are null
+*/
+int vioblk_getlatstats (
+    const struct vioblk_device * dev, struct io_latstats * statsptr)
+{
+    if (statsptr == NULL || dev == NULL) return -EINVAL;
+
+    int s = intr_disable(); //submitting threads update these
+    statsptr->poll_us = dev->poll_us;
+    for (int mode = 0; mode < IO_WAIT_NMODE; mode++) {
+        const uint64_t cnt = dev->latcnt[mode];
+        uint64_t seen = 0;
+
+        statsptr->mode[mode].requests = cnt;
+        statsptr->mode[mode].p50 = 0;
+        statsptr->mode[mode].p99 = 0;
+        for (int b = 0; b < VIOBLK_LATBUCKETS && cnt != 0; b++) {
+            seen += dev->lathist[mode][b];
+            if (statsptr->mode[mode].p50 == 0 && seen * 100 >= cnt * 50)
+                statsptr->mode[mode].p50 = 2ULL << b;
+            if (statsptr->mode[mode].p99 == 0 && seen * 100 >= cnt * 99)
+                statsptr->mode[mode].p99 = 2ULL << b;
+        }
+    }
+    intr_restore(s);
+
+    return 0;
+}
+
+/*
+sets how many microseconds a submitting thread busy-polls for its completion before sleeping;
+0 turns polling off.
+returns 0 if successful, invalid if inputs are null
+*/
+int vioblk_setpoll(struct vioblk_device * dev, const unsigned long * usptr) {
+    if (usptr == NULL || dev == NULL) return -EINVAL;
+
+    int s = intr_disable();
+    dev->poll_us = *usptr;
+    dev->poll_ticks = *usptr * (TIMER_FREQ / 1000000);
+    intr_restore(s);
+
+    return 0;
+}
+
+/*
+copies the request counters and per-stage latency histograms into statsptr. Comparing the QUEUE
+and DEVICE stages shows whether slow requests wait in the scheduler or in the device.
+returns 0 if successful, invalid if input ptrs are null
+*/
+int vioblk_getstats (
+    const struct vioblk_device * dev, struct io_blkstats * statsptr)
+{
+    if (statsptr == NULL || dev == NULL) return -EINVAL;
+
+    int s = intr_disable(); //submitting threads update these
+    *statsptr = dev->stats;
+    intr_restore(s);
+
+    return 0;
+}